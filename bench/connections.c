@@ -0,0 +1,189 @@
+// make bench [BENCH_CONNECTIONS=N]
+//
+// Sets up N client/server pairs of HTTP 2 connections that talk to each other through memory,
+// brings all of them into the same state, and reports how much memory one connection (i.e.
+// one side of a pair) takes on average: the heap as seen by a counting allocator, plus the
+// structure itself, then the breakdown from `cno_memory_usage`. This is for tracking the
+// effect of layout changes, so only sizes are measured, not time.
+#include <stdio.h>
+
+#include <cno/core.h>
+
+#define BENCH_STREAMS 10
+#define BENCH_HPACK_ROUNDS 32
+
+static size_t live;
+
+static void *bench_alloc(void *ctx, size_t n) {
+    void *p = malloc(n);
+    *(size_t *) ctx += p ? n : 0;
+    return p;
+}
+
+static void *bench_realloc(void *ctx, void *ptr, size_t old, size_t n) {
+    void *p = realloc(ptr, n);
+    *(size_t *) ctx += p ? n - old : 0;
+    return p;
+}
+
+static void bench_free(void *ctx, void *ptr, size_t n) {
+    *(size_t *) ctx -= n;
+    free(ptr);
+}
+
+static const struct cno_allocator_t BENCH_ALLOCATOR = { bench_alloc, bench_realloc, bench_free, &live };
+
+struct bench_peer_t {
+    struct cno_connection_t c;
+    struct cno_buffer_dyn_t out; // not yet delivered to the other side; not counted
+    struct bench_peer_t *other;
+};
+
+static int bench_respond;
+
+static int bench_on_writev(void *p, const struct cno_buffer_t *iov, size_t n) {
+    struct bench_peer_t *peer = p;
+    for (size_t i = 0; i < n; i++)
+        if (cno_buffer_dyn_concat(&peer->out, iov[i]))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+// Distinct names and values so that every header goes into the dynamic table.
+static void bench_headers(struct cno_header_t *h, char (*text)[2][80], uint32_t round, const char *side) {
+    for (int i = 0; i < 3; i++) {
+        int k = snprintf(text[i][0], sizeof(text[i][0]), "x-bench-%s-%u-%d", side, round, i);
+        int v = snprintf(text[i][1], sizeof(text[i][1]), "%064u", round * 3 + i);
+        h[i] = (struct cno_header_t) { { text[i][0], k }, { text[i][1], v }, 0 };
+    }
+}
+
+static int bench_on_message_head(void *p, uint32_t id, const struct cno_message_t *m) {
+    struct bench_peer_t *peer = p;
+    (void) m;
+    if (peer->c.client || !bench_respond)
+        return CNO_OK;
+    struct cno_header_t h[3];
+    char text[3][2][80];
+    bench_headers(h, text, id, "response");
+    struct cno_message_t r = { 200, {}, {}, h, 3 };
+    return cno_write_head(&peer->c, id, &r, 1);
+}
+
+static const struct cno_vtable_t BENCH_VTABLE = {
+    .on_writev       = bench_on_writev,
+    .on_message_head = bench_on_message_head,
+};
+
+static int bench_pump(struct bench_peer_t *a) {
+    for (struct bench_peer_t *p = a; p->out.size || p->other->out.size; p = p->other) {
+        struct cno_buffer_dyn_t out = p->out;
+        p->out = (struct cno_buffer_dyn_t) {};
+        int ret = cno_consume(&p->other->c, out.data, out.size);
+        cno_buffer_dyn_clear(&out);
+        if (ret)
+            return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+static int bench_request(struct bench_peer_t *client, uint32_t round, int extra) {
+    struct cno_header_t h[5] = {
+        { CNO_BUFFER_STRING(":scheme"),    CNO_BUFFER_STRING("https"),     0 },
+        { CNO_BUFFER_STRING(":authority"), CNO_BUFFER_STRING("localhost"), 0 },
+    };
+    char text[3][2][80];
+    if (extra)
+        bench_headers(h + 2, text, round, "request");
+    struct cno_message_t m = { 0, CNO_BUFFER_STRING("GET"), CNO_BUFFER_STRING("/"), h, extra ? 5 : 2 };
+    return cno_write_head(&client->c, cno_next_stream(&client->c), &m, 1) || bench_pump(client) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+static int bench_idle(struct bench_peer_t *pair) {
+    (void) pair;
+    return CNO_OK;
+}
+
+static int bench_streams(struct bench_peer_t *pair) {
+    bench_respond = 0;
+    for (int i = 0; i < BENCH_STREAMS; i++)
+        if (bench_request(&pair[0], i, 0))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+static int bench_hpack(struct bench_peer_t *pair) {
+    bench_respond = 1;
+    for (int i = 0; i < BENCH_HPACK_ROUNDS; i++)
+        if (bench_request(&pair[0], i, 1))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+static int bench_hpack_hibernated(struct bench_peer_t *pair) {
+    if (bench_hpack(pair))
+        return CNO_ERROR_UP();
+    return cno_hibernate(&pair[0].c, 1) || cno_hibernate(&pair[1].c, 1) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+static const struct {
+    const char *name;
+    int (*setup)(struct bench_peer_t *);
+} BENCH_STATES[] = {
+    { "idle",                     bench_idle },
+    { "10 streams",               bench_streams },
+    { "full hpack tables",        bench_hpack },
+    { "full hpack, hibernated",   bench_hpack_hibernated },
+};
+
+static int bench_run(struct bench_peer_t *pairs, size_t n, int (*setup)(struct bench_peer_t *)) {
+    for (size_t i = 0; i < n; i++) {
+        struct bench_peer_t *pair = &pairs[i * 2];
+        for (int k = 0; k < 2; k++) {
+            cno_init(&pair[k].c, k ? CNO_SERVER : CNO_CLIENT);
+            pair[k].c.cb_code = &BENCH_VTABLE;
+            pair[k].c.cb_data = &pair[k];
+            pair[k].c.allocator = &BENCH_ALLOCATOR;
+            pair[k].other = &pair[!k];
+        }
+        if (cno_begin(&pair[0].c, CNO_HTTP2) || cno_begin(&pair[1].c, CNO_HTTP2) || bench_pump(pair) || setup(pair))
+            return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    struct bench_peer_t *pairs = calloc(n * 2, sizeof(struct bench_peer_t));
+    if (n == 0 || pairs == NULL)
+        return fprintf(stderr, "usage: %s [number of connection pairs > 0]\n", argv[0]), 1;
+
+    printf("%-24s %9s | %7s %7s %7s %7s %7s %7s %7s\n", "state", "bytes", "struct", "buffers",
+           "streams", "pool", "encoder", "decoder", "total");
+    for (size_t s = 0; s < sizeof(BENCH_STATES) / sizeof(BENCH_STATES[0]); s++) {
+        if (bench_run(pairs, n, BENCH_STATES[s].setup))
+            return fprintf(stderr, "%s: %s\n", BENCH_STATES[s].name, cno_error()->text), 1;
+        struct cno_memory_usage_t sum = {};
+        for (size_t i = 0; i < n * 2; i++) {
+            struct cno_memory_usage_t u;
+            cno_memory_usage(&pairs[i].c, &u);
+            sum.connection  += u.connection;
+            sum.buffers     += u.buffers;
+            sum.streams     += u.streams;
+            sum.stream_pool += u.stream_pool;
+            sum.encoder     += u.encoder;
+            sum.decoder     += u.decoder;
+            sum.total       += u.total;
+        }
+        printf("%-24s %9zu | %7zu %7zu %7zu %7zu %7zu %7zu %7zu\n", BENCH_STATES[s].name,
+               (live + sizeof(struct cno_connection_t) * n * 2) / (n * 2), sum.connection / (n * 2),
+               sum.buffers / (n * 2), sum.streams / (n * 2), sum.stream_pool / (n * 2),
+               sum.encoder / (n * 2), sum.decoder / (n * 2), sum.total / (n * 2));
+        for (size_t i = 0; i < n * 2; i++) {
+            cno_fini(&pairs[i].c);
+            cno_buffer_dyn_clear(&pairs[i].out);
+        }
+    }
+    free(pairs);
+    return 0;
+}
@@ -0,0 +1,112 @@
+import os
+import sys
+import zlib
+import json
+import random
+
+
+#     python3 bench/hpack-corpus.py <output dir> [hpack-test-case story.json ...]
+#
+# Writes one corpus per file in a format `bench/hpack.c` can read without a JSON parser:
+# a header block is a sequence of "name: value" lines, blocks are separated by empty lines.
+# Each file is one direction of one connection, i.e. is encoded with a single dynamic table.
+# Stories (https://github.com/http2jp/hpack-test-case, `raw-data` or any implementation's
+# directory) are converted as is; the synthetic mixes below are always generated.
+
+
+def browser(rng):
+    # A few page loads with subresources from two origins. Cookies and user agent are
+    # constant, paths and conditional request headers are not.
+    ua = 'Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0'
+    cookie = 'session=%032x; _ga=GA1.2.%d.%d; theme=dark' % (rng.getrandbits(128), rng.getrandbits(30), rng.getrandbits(30))
+    kinds = [
+        ('js',   'application/javascript', '*/*',                                 'script'),
+        ('css',  'text/css',               'text/css,*/*;q=0.1',                  'style'),
+        ('png',  'image/png',              'image/avif,image/webp,*/*;q=0.8',     'image'),
+        ('woff2','font/woff2',             'application/font-woff2;q=1.0,*/*;q=0.9', 'font'),
+    ]
+    for page in range(40):
+        path = '/%s/%d' % (rng.choice(['news', 'article', 'search', 'user']), rng.randrange(100000))
+        requests, responses = [], []
+        for i in range(rng.randrange(8, 30)):
+            first = i == 0
+            kind, ctype, accept, dest = kinds[rng.randrange(len(kinds))] if not first else \
+                ('html', 'text/html; charset=utf-8', 'text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8', 'document')
+            host = 'www.example.com' if first or rng.random() < 0.6 else 'static.example-cdn.net'
+            rpath = path if first else '/assets/%s/%08x.%s' % (kind, rng.randrange(200), kind)
+            tag = '"%08x"' % zlib.crc32(rpath.encode())
+            req = [(':method', 'GET'), (':scheme', 'https'), (':authority', host), (':path', rpath),
+                   ('user-agent', ua), ('accept', accept), ('accept-language', 'en-US,en;q=0.5'),
+                   ('accept-encoding', 'gzip, deflate, br, zstd'), ('sec-fetch-dest', dest),
+                   ('sec-fetch-mode', 'navigate' if first else 'no-cors'), ('sec-fetch-site', 'same-origin')]
+            if host == 'www.example.com':
+                req.append(('cookie', cookie))
+            if not first:
+                req.append(('referer', 'https://www.example.com' + path))
+            cached = not first and rng.random() < 0.4
+            if cached:
+                req.append(('if-none-match', tag))
+            requests.append(req)
+            resp = [(':status', '304' if cached else '200'),
+                    ('date', 'Fri, 16 Oct 2026 12:%02d:%02d GMT' % (page // 20, page * 3 % 60)),
+                    ('server', 'nginx/1.27.1' if host == 'www.example.com' else 'cdn-edge')]
+            if not cached:
+                resp += [('content-type', ctype), ('content-length', str(rng.randrange(200, 200000))),
+                         ('content-encoding', 'br') if kind in ('html', 'js', 'css') else ('accept-ranges', 'bytes')]
+            resp += [('etag', tag), ('cache-control', 'no-cache' if first else 'public, max-age=31536000, immutable'),
+                     ('x-request-id', '%032x' % rng.getrandbits(128))]
+            if first and rng.random() < 0.3:
+                resp.append(('set-cookie', 'csrf=%016x; Path=/; Secure; HttpOnly; SameSite=Lax' % rng.getrandbits(64)))
+            responses.append(resp)
+        yield requests, responses
+
+
+def api(rng):
+    # A JSON API client polling and updating resources: mostly identical headers with a few
+    # ids that change on every request.
+    token = 'Bearer ' + ''.join(rng.choice('abcdefghijklmnopqrstuvwxyz0123456789') for _ in range(120))
+    for i in range(1000):
+        method = rng.choice(['GET', 'GET', 'GET', 'POST', 'PATCH', 'DELETE'])
+        path = '/v2/%s/%d' % (rng.choice(['orders', 'customers', 'products']), rng.randrange(5000))
+        if method == 'GET' and rng.random() < 0.5:
+            path = path.rsplit('/', 1)[0] + '?page=%d&limit=50' % rng.randrange(20)
+        req = [(':method', method), (':scheme', 'https'), (':authority', 'api.example.com'), (':path', path),
+               ('authorization', token), ('accept', 'application/json'), ('user-agent', 'example-sdk-python/3.2.1'),
+               ('x-request-id', '%08x-%04x-%04x-%04x-%012x' % tuple(rng.getrandbits(b) for b in (32, 16, 16, 16, 48))),
+               ('traceparent', '00-%032x-%016x-01' % (rng.getrandbits(128), rng.getrandbits(64)))]
+        if method in ('POST', 'PATCH'):
+            req += [('content-type', 'application/json'), ('content-length', str(rng.randrange(40, 2000)))]
+        status = rng.choice(['200'] * 8 + ['201', '404', '429'])
+        resp = [(':status', status), ('date', 'Fri, 16 Oct 2026 13:%02d:%02d GMT' % (i // 600, i // 10 % 60)),
+                ('content-type', 'application/json'), ('content-length', str(rng.randrange(2, 20000))),
+                ('x-ratelimit-limit', '5000'), ('x-ratelimit-remaining', str(5000 - i)),
+                ('x-request-id', req[7][1]), ('vary', 'accept-encoding, authorization'),
+                ('strict-transport-security', 'max-age=63072000; includeSubDomains; preload')]
+        yield [req], [resp]
+
+
+def write(path, blocks):
+    with open(path, 'w') as fd:
+        for headers in blocks:
+            fd.write(''.join('%s: %s\n' % kv for kv in headers) + '\n')
+
+
+def story(path):
+    with open(path) as fd:
+        cases = json.load(fd)['cases']
+    # Each header is a single-entry object; some stories have no `headers` for a case.
+    return [[next(iter(h.items())) for h in case.get('headers', [])] for case in cases]
+
+
+out = sys.argv[1]
+os.makedirs(out, exist_ok=True)
+for name, gen in [('browser', browser), ('api', api)]:
+    requests, responses = [], []
+    for a, b in gen(random.Random(name)):
+        requests += a
+        responses += b
+    write(os.path.join(out, name + '-requests'), requests)
+    write(os.path.join(out, name + '-responses'), responses)
+for path in sys.argv[2:]:
+    write(os.path.join(out, '%s-%s' % (os.path.basename(os.path.dirname(os.path.abspath(path))),
+                                       os.path.splitext(os.path.basename(path))[0])), story(path))
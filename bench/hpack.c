@@ -0,0 +1,233 @@
+// make bench [BENCH_STORIES="path/to/hpack-test-case/*/story_*.json"]
+//
+// Encodes each corpus (see hpack-corpus.py) with a single encoder, as one direction of
+// a connection would, then decodes the result and checks that it matches the input.
+// The `huf` rows decode the corpus encoded without a dynamic table, so nearly every value
+// is a Huffman-coded literal; set HUFFMAN_INPUT_BITS in cno/hpack-data.py to 4 to compare
+// with the old decoding table.
+// Throughput is in terms of the raw headers, i.e. name + value bytes; the ratio is encoded
+// size / raw size. Allocations are counted through the tables' allocator.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+
+#include <cno/hpack.h>
+
+#define BENCH_MIN_SECONDS 0.3
+
+static const uint32_t BENCH_TABLE_SIZE[2] = { 4096, 0 };
+
+static size_t allocs;
+
+static void *bench_alloc(void *ctx, size_t n) {
+    ++*(size_t *) ctx;
+    return malloc(n);
+}
+
+static void *bench_realloc(void *ctx, void *ptr, size_t old, size_t n) {
+    (void) old;
+    ++*(size_t *) ctx;
+    return realloc(ptr, n);
+}
+
+static void bench_free(void *ctx, void *ptr, size_t n) {
+    (void) ctx;
+    (void) n;
+    free(ptr);
+}
+
+static const struct cno_allocator_t BENCH_ALLOCATOR = { bench_alloc, bench_realloc, bench_free, &allocs };
+
+struct bench_corpus_t {
+    struct cno_buffer_dyn_t text;
+    struct cno_buffer_dyn_t headers;  // of `struct cno_header_t`, pointing into `text`
+    struct cno_buffer_dyn_t blocks;   // of `size_t`: number of headers in each block
+    struct cno_buffer_dyn_t encoded[2];  // all blocks, back to back, with and without a dynamic table
+    struct cno_buffer_dyn_t sizes[2];    // of `size_t`: encoded size of each block
+    size_t raw;
+};
+
+struct bench_result_t {
+    size_t headers, raw, encoded, allocs;
+    double seconds;
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define bench_append(buf, x) cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { (const char *) &(x), sizeof(x) })
+#define bench_items(buf, T) ((T *) (buf).data)
+#define bench_count(buf, T) ((buf).size / sizeof(T))
+
+static int bench_load(struct bench_corpus_t *c, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return CNO_ERROR(ASSERTION, "%s: cannot open", path);
+    char chunk[65536];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f));)
+        if (cno_buffer_dyn_concat(&c->text, (struct cno_buffer_t) { chunk, n }))
+            return fclose(f), CNO_ERROR_UP();
+    fclose(f);
+
+    // "name: value\n" lines; an empty line ends a block. Pseudo-header names start with
+    // a colon, so the separator is searched for after the first character.
+    size_t in_block = 0;
+    for (char *line = c->text.data, *end = c->text.data + c->text.size, *eol; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if (eol == line) {
+            if (in_block && bench_append(&c->blocks, in_block))
+                return CNO_ERROR_UP();
+            in_block = 0;
+            continue;
+        }
+        char *sep = line + 1;
+        while (sep + 1 < eol && (sep[0] != ':' || sep[1] != ' '))
+            sep++;
+        if (sep + 1 >= eol)
+            return CNO_ERROR(ASSERTION, "%s: malformed line", path);
+        struct cno_header_t h = { { line, sep - line }, { sep + 2, eol - sep - 2 }, 0 };
+        if (bench_append(&c->headers, h))
+            return CNO_ERROR_UP();
+        c->raw += h.name.size + h.value.size;
+        in_block++;
+    }
+    if (in_block && bench_append(&c->blocks, in_block))
+        return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+static int bench_encode(struct bench_corpus_t *c, int k, struct bench_result_t *r, double min_seconds) {
+    struct cno_buffer_dyn_t buf = {};
+    double start = bench_now();
+    do {
+        struct cno_hpack_t enc;
+        cno_hpack_init(&enc, BENCH_TABLE_SIZE[k]);
+        enc.allocator = &BENCH_ALLOCATOR;
+        const struct cno_header_t *h = bench_items(c->headers, struct cno_header_t);
+        const size_t *n = bench_items(c->blocks, size_t);
+        for (size_t i = 0; i < bench_count(c->blocks, size_t); h += n[i++]) {
+            buf.size = 0;
+            if (cno_hpack_encode(&enc, &buf, h, n[i]))
+                return cno_hpack_clear(&enc), cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &buf), CNO_ERROR_UP();
+            // Keep the output of the first run for the decoder.
+            if (r->headers == 0 && (cno_buffer_dyn_concat(&c->encoded[k], (struct cno_buffer_t) { buf.data, buf.size })
+                                 || bench_append(&c->sizes[k], buf.size)))
+                return cno_hpack_clear(&enc), cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &buf), CNO_ERROR_UP();
+        }
+        cno_hpack_clear(&enc);
+        r->headers += bench_count(c->headers, struct cno_header_t);
+        r->raw     += c->raw;
+    } while ((r->seconds = bench_now() - start) < min_seconds);
+    cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &buf);
+    r->encoded = c->encoded[k].size;
+    return CNO_OK;
+}
+
+static int bench_decode(struct bench_corpus_t *c, int k, struct bench_result_t *r) {
+    struct cno_buffer_dyn_t arena = {};
+    struct cno_header_t *out = malloc(sizeof(struct cno_header_t) * bench_count(c->headers, struct cno_header_t));
+    if (out == NULL)
+        return CNO_ERROR(NO_MEMORY, "--");
+    double start = bench_now();
+    do {
+        struct cno_hpack_t dec;
+        cno_hpack_init(&dec, BENCH_TABLE_SIZE[k]);
+        dec.allocator = &BENCH_ALLOCATOR;
+        const char *p = c->encoded[k].data;
+        const size_t *sizes = bench_items(c->sizes[k], size_t);
+        const struct cno_header_t *expect = bench_items(c->headers, struct cno_header_t);
+        for (size_t i = 0; i < bench_count(c->sizes[k], size_t); p += sizes[i++]) {
+            size_t n = bench_count(c->headers, struct cno_header_t);
+            arena.size = 0;
+            if (cno_hpack_decode_into(&dec, &arena, (struct cno_buffer_t) { p, sizes[i] }, out, &n))
+                return cno_hpack_clear(&dec), cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &arena), free(out), CNO_ERROR_UP();
+            if (n != bench_items(c->blocks, size_t)[i])
+                return cno_hpack_clear(&dec), cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &arena), free(out), CNO_ERROR(ASSERTION, "header count mismatch");
+            // The output of a broken encoder may still decode; compare on the first pass only.
+            for (size_t j = 0; r->headers == 0 && j < n; j++, expect++)
+                if (!cno_buffer_eq(out[j].name, expect->name) || !cno_buffer_eq(out[j].value, expect->value))
+                    return cno_hpack_clear(&dec), cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &arena), free(out),
+                           CNO_ERROR(ASSERTION, "block %zu, header %zu does not match the input", i, j);
+            while (n--)
+                cno_hpack_free_header(&out[n]);
+        }
+        cno_hpack_clear(&dec);
+        r->headers += bench_count(c->headers, struct cno_header_t);
+        r->raw     += c->raw;
+    } while ((r->seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+    cno_buffer_dyn_clear_with(&BENCH_ALLOCATOR, &arena);
+    free(out);
+    return CNO_OK;
+}
+
+static void bench_print(const char *name, const char *op, const struct bench_result_t *r, size_t raw) {
+    printf("%-32s %s %9zu %10.3f %9.1f %6.1f%% %8.3f\n", name, op, r->headers / (r->raw / raw),
+        r->headers / r->seconds / 1e6, r->raw / r->seconds / 1e6, 100.0 * r->encoded / raw,
+        (double) r->allocs / r->headers);
+}
+
+int main(int argc, char **argv) {
+    static const char *const ops[3] = { "enc", "dec", "huf" };
+    struct bench_result_t total[3] = {};
+    size_t total_raw = 0;
+    printf("%-32s %s %9s %10s %9s %7s %8s\n", "corpus", "op ", "headers", "Mheaders/s", "MB/s", "ratio", "allocs/h");
+    for (int i = 1; i < argc; i++) {
+        struct bench_corpus_t c = {};
+        struct bench_result_t r[4] = {};
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        if (bench_load(&c, argv[i]))
+            goto error;
+        if (!c.raw)
+            goto done;
+        allocs = 0;
+        if (bench_encode(&c, 0, &r[0], BENCH_MIN_SECONDS))
+            goto error;
+        r[0].allocs = allocs;
+        allocs = 0;
+        if (bench_decode(&c, 0, &r[1]))
+            goto error;
+        r[1].allocs = allocs;
+        r[1].encoded = r[0].encoded;
+        // Only the output is needed here, so a single pass will do.
+        if (bench_encode(&c, 1, &r[3], 0))
+            goto error;
+        allocs = 0;
+        if (bench_decode(&c, 1, &r[2]))
+            goto error;
+        r[2].allocs = allocs;
+        r[2].encoded = r[3].encoded;
+        for (int k = 0; k < 3; k++)
+            bench_print(name, ops[k], &r[k], c.raw);
+        for (int k = 0; k < 3; k++) {
+            // Normalize to one pass over each corpus so that they are weighted by size.
+            total[k].headers += bench_count(c.headers, struct cno_header_t);
+            total[k].encoded += r[k].encoded;
+            total[k].allocs  += r[k].allocs * c.raw / r[k].raw;
+            total[k].seconds += r[k].seconds * c.raw / r[k].raw;
+        }
+        total_raw += c.raw;
+    done:
+        cno_buffer_dyn_clear(&c.text);
+        cno_buffer_dyn_clear(&c.headers);
+        cno_buffer_dyn_clear(&c.blocks);
+        for (int k = 0; k < 2; k++) {
+            cno_buffer_dyn_clear(&c.encoded[k]);
+            cno_buffer_dyn_clear(&c.sizes[k]);
+        }
+        continue;
+    error:
+        fprintf(stderr, "%s: %s\n", argv[i], cno_error()->text);
+        return 1;
+    }
+    if (total_raw) {
+        for (int k = 0; k < 3; k++) {
+            total[k].raw = total_raw;
+            bench_print("total", ops[k], &total[k], total_raw);
+        }
+    }
+    return 0;
+}
@@ -51,6 +51,17 @@ struct cno_buffer_dyn_t {
     size_t cap;
 };
 
+// Where memory comes from. Each function gets `ctx` as the first argument; `realloc` and `free`
+// are also told the size the block was obtained with, so that e.g. accounting wrappers don't
+// have to track it. Wherever a `const struct cno_allocator_t *` is NULL, the C library's
+// `malloc`, `realloc`, and `free` are used instead. `free` is never called with NULL.
+struct cno_allocator_t {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+};
+
 // cffi does not compile inline functions
 #if !CFFI_CDEF_MODE
 
@@ -78,8 +89,25 @@ static inline struct cno_buffer_t cno_buffer_shift(const struct cno_buffer_t x,
     return (struct cno_buffer_t) {x.data + offset, x.size - offset};
 }
 
-static inline void cno_buffer_dyn_clear(struct cno_buffer_dyn_t *x) {
-    free(x->data - x->offset);
+static inline void *cno_alloc(const struct cno_allocator_t *a, size_t size) {
+    return a ? a->alloc(a->ctx, size) : malloc(size);
+}
+
+static inline void *cno_realloc(const struct cno_allocator_t *a, void *ptr, size_t old_size, size_t size) {
+    return a ? a->realloc(a->ctx, ptr, old_size, size) : realloc(ptr, size);
+}
+
+static inline void cno_free(const struct cno_allocator_t *a, void *ptr, size_t size) {
+    if (!a)
+        free(ptr);
+    else if (ptr)
+        a->free(a->ctx, ptr, size);
+}
+
+// The `_with` variants of the functions below take the allocator the buffer's memory
+// comes from; the rest use the C library's.
+static inline void cno_buffer_dyn_clear_with(const struct cno_allocator_t *a, struct cno_buffer_dyn_t *x) {
+    cno_free(a, x->data - x->offset, x->cap + x->offset);
     *x = (struct cno_buffer_dyn_t) {};
 }
 
@@ -90,7 +118,7 @@ static inline void cno_buffer_dyn_shift(struct cno_buffer_dyn_t *x, size_t off)
     x->offset += off;
 }
 
-static inline int cno_buffer_dyn_reserve(struct cno_buffer_dyn_t *x, size_t n) {
+static inline int cno_buffer_dyn_reserve_with(const struct cno_allocator_t *a, struct cno_buffer_dyn_t *x, size_t n) {
     if (n <= x->cap)
         return CNO_OK;
 
@@ -108,12 +136,14 @@ static inline int cno_buffer_dyn_reserve(struct cno_buffer_dyn_t *x, size_t n) {
     if (n < cap * CNO_BUFFER_ALLOC_MIN_EXP)
         n = cap * CNO_BUFFER_ALLOC_MIN_EXP;
 
-    char *m = (char *) malloc(n);
+    // Without an offset, the allocator may be able to extend the block in place.
+    char *m = (char *) (x->data && !x->offset ? cno_realloc(a, x->data, x->cap, n) : cno_alloc(a, n));
     if (m == NULL)
         return CNO_ERROR(NO_MEMORY, "%zu bytes", n);
-    if (x->data != NULL)
+    if (x->data != NULL && x->offset) {
         memcpy(m, x->data, x->size);
-    free(x->data - x->offset);
+        cno_free(a, x->data - x->offset, x->cap + x->offset);
+    }
 
     x->data   = m;
     x->cap    = n;
@@ -121,11 +151,13 @@ static inline int cno_buffer_dyn_reserve(struct cno_buffer_dyn_t *x, size_t n) {
     return CNO_OK;
 }
 
-static inline int cno_buffer_dyn_concat(struct cno_buffer_dyn_t *a, const struct cno_buffer_t b) {
+static inline int cno_buffer_dyn_concat_with(const struct cno_allocator_t *alloc, struct cno_buffer_dyn_t *a,
+                                             const struct cno_buffer_t b)
+{
     if (b.size == 0)
         return CNO_OK;
 
-    if (cno_buffer_dyn_reserve(a, a->size + b.size))
+    if (cno_buffer_dyn_reserve_with(alloc, a, a->size + b.size))
         return CNO_ERROR_UP();
 
     memcpy(a->data + a->size, b.data, b.size);
@@ -133,6 +165,18 @@ static inline int cno_buffer_dyn_concat(struct cno_buffer_dyn_t *a, const struct
     return CNO_OK;
 }
 
+static inline void cno_buffer_dyn_clear(struct cno_buffer_dyn_t *x) {
+    cno_buffer_dyn_clear_with(NULL, x);
+}
+
+static inline int cno_buffer_dyn_reserve(struct cno_buffer_dyn_t *x, size_t n) {
+    return cno_buffer_dyn_reserve_with(NULL, x, n);
+}
+
+static inline int cno_buffer_dyn_concat(struct cno_buffer_dyn_t *a, const struct cno_buffer_t b) {
+    return cno_buffer_dyn_concat_with(NULL, a, b);
+}
+
 #endif
 
 #if __cplusplus
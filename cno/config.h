@@ -12,23 +12,30 @@
 #endif
 
 #ifndef CNO_MAX_HEADERS
-// Max. number of entries in the header table of inbound messages. Applies to both HTTP 1
-// and HTTP 2. Does not affect outbound messages. Controls stack space usage.
+// Max. number of entries in the header table of inbound HTTP 1 messages. (HTTP 2 is only
+// limited by the max_header_list_size setting.) Controls heap usage per connection.
 #define CNO_MAX_HEADERS 64
 #endif
 
 #ifndef CNO_MAX_CONTINUATIONS
-// In HTTP 2 mode, only this many CONTINUATIONs are accepted in a row. In HTTP 1 mode,
-// the total length of all headers cannot exceed (this value + 1) * (max HTTP 2 frame size)
-// + (size of the transport level read buffer). Controls peak memory consumption.
+// In HTTP 1 mode, the total length of all headers cannot exceed (this value + 1) * (max
+// HTTP 2 frame size) + (size of the transport level read buffer). Controls peak memory
+// consumption. HTTP 2 header blocks are decoded as frames arrive and can be split into
+// any number of CONTINUATIONs, limited only by the max_header_list_size setting.
 #define CNO_MAX_CONTINUATIONS 3
 #endif
 
-#ifndef CNO_STREAM_BUCKETS
-// Number of buckets in the "stream id -> stream object" hash map. Must be prime to
-// ensure an even distribution. Controls stack/heap usage, depending on where connection
-// objects are allocated.
-#define CNO_STREAM_BUCKETS 61
+#ifndef CNO_CORK_COPY_MAX
+// While output is corked (see `cno_cork`), buffers up to this size are copied into a
+// per-connection queue; a bigger one is passed by reference and flushes the queue.
+// Controls the number of `on_writev` calls vs. the amount of copying.
+#define CNO_CORK_COPY_MAX 4096
+#endif
+
+#ifndef CNO_STREAM_POOL_LIMIT
+// Max. number of ended streams' objects a connection keeps for reuse, unless it is given
+// a shared pool. Controls heap usage per connection vs. allocations per stream.
+#define CNO_STREAM_POOL_LIMIT 8
 #endif
 
 #ifndef CNO_STREAM_RESET_HISTORY
@@ -36,3 +43,9 @@
 // will be ignored under the assumption that the other side has not seen the reset yet.
 #define CNO_STREAM_RESET_HISTORY 10
 #endif
+
+#ifndef CNO_HPACK_NAME_STATS
+// Number of slots in the table of per-name statistics that the HPACK encoder uses to decide
+// whether a header is worth indexing. Names may share slots. Controls memory usage.
+#define CNO_HPACK_NAME_STATS 64
+#endif
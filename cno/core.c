@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 
 #include "core.h"
@@ -10,6 +11,7 @@ enum CNO_CONNECTION_STATE {
     CNO_STATE_H2_PREFACE,
     CNO_STATE_H2_SETTINGS,
     CNO_STATE_H2_FRAME,
+    CNO_STATE_H2_DATA,
     CNO_STATE_H1_HEAD,
     CNO_STATE_H1_BODY,
     CNO_STATE_H1_TAIL,
@@ -25,16 +27,34 @@ enum CNO_STREAM_STATE {
     CNO_STREAM_CLOSED,
 };
 
+// A piece of data passed to `cno_queue_data`, not yet sent.
+struct cno_queued_t {
+    struct cno_buffer_t data;
+    void *token;
+    uint8_t final;
+};
+
 struct cno_stream_t {
-    struct cno_stream_t *next; // in hashmap bucket
     uint32_t id;
     uint8_t /* enum CNO_STREAM_STATE */ r_state;
     uint8_t /* enum CNO_STREAM_STATE */ w_state;
     uint8_t writing_chunked : 1;
     uint8_t reading_head_response : 1;
-     int64_t window_recv;
+    uint8_t urgency : 3;
+    uint8_t incremental : 1;
+    uint8_t end_received : 1; // the peer has sent END_STREAM, but the stream may not be closed yet
+    struct cno_stream_t *sched_prev; // NULL if not waiting to write; see `cno_want_write`
+    struct cno_stream_t *sched_next;
+    union {
+         int64_t window_recv;
+        struct cno_stream_t *next_free; // while in a `cno_stream_pool_t`
+    };
      int64_t window_send;
+    uint32_t window_recv_pending; // credit not yet returned with a WINDOW_UPDATE
+    uint32_t window_recv_grown;   // how much of `window_stream_grown` this stream has been given
     uint64_t remaining_payload;
+    void *data; // see `cno_stream_set_data`
+    struct cno_buffer_dyn_t send_queue; // `struct cno_queued_t`s; see `cno_queue_data`
 };
 
 static inline uint32_t read4(const void *v) {
@@ -50,9 +70,82 @@ static inline uint32_t read4(const void *v) {
 
 #define CNO_FIRE(ob, cb, ...) (ob->cb_code && ob->cb_code->cb && ob->cb_code->cb(ob->cb_data, ##__VA_ARGS__))
 
-#define CNO_WRITEV(c, ...) CNO_FIRE(c, on_writev, (struct cno_buffer_t[]){__VA_ARGS__}, \
+#define CNO_WRITEV(c, ...) cno_writev(c, (struct cno_buffer_t[]){__VA_ARGS__}, \
     sizeof((struct cno_buffer_t[]){__VA_ARGS__}) / sizeof(struct cno_buffer_t))
 
+static int cno_flush(struct cno_connection_t *c) {
+    // Copied pieces are stored as `{NULL, size}` because `cork_data` may have moved since.
+    struct cno_buffer_t *iov = (struct cno_buffer_t *) c->cork_iov.data;
+    size_t n = c->cork_iov.size / sizeof(struct cno_buffer_t);
+    const char *copied = c->cork_data.data;
+    for (size_t i = 0; i < n; i++)
+        if (iov[i].data == NULL)
+            iov[i].data = copied, copied += iov[i].size;
+    int ret = n && CNO_FIRE(c, on_writev, iov, n);
+    c->cork_iov.size = c->cork_data.size = 0;
+    return ret ? CNO_ERROR_UP() : CNO_OK;
+}
+
+// While corked, small pieces are copied and sent later as part of a single `on_writev`.
+// Bigger ones are not worth copying, so they flush everything queued so far instead.
+static int cno_writev(struct cno_connection_t *c, const struct cno_buffer_t *iov, size_t n) {
+    if (!c->corked)
+        return CNO_FIRE(c, on_writev, iov, n);
+    int flush = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct cno_buffer_t piece = iov[i];
+        if (!piece.size)
+            continue;
+        if (piece.size <= CNO_CORK_COPY_MAX) {
+            if (cno_buffer_dyn_concat_with(c->allocator, &c->cork_data, piece))
+                return CNO_ERROR_UP();
+            struct cno_buffer_t *last = c->cork_iov.size
+                ? (struct cno_buffer_t *) (c->cork_iov.data + c->cork_iov.size) - 1 : NULL;
+            if (last && last->data == NULL) {
+                last->size += piece.size;
+                continue;
+            }
+            piece.data = NULL;
+        } else {
+            flush = 1;
+        }
+        if (cno_buffer_dyn_concat_with(c->allocator, &c->cork_iov, (struct cno_buffer_t) { (const char *) &piece, sizeof(piece) }))
+            return CNO_ERROR_UP();
+    }
+    return flush ? cno_flush(c) : CNO_OK;
+}
+
+// Queue pieces by reference regardless of size. The queue must be flushed before they go away.
+static int cno_writev_ref(struct cno_connection_t *c, const struct cno_buffer_t *iov, size_t n) {
+    if (!c->corked)
+        return CNO_FIRE(c, on_writev, iov, n);
+    for (size_t i = 0; i < n; i++)
+        if (iov[i].size && cno_buffer_dyn_concat_with(c->allocator, &c->cork_iov, (struct cno_buffer_t) { (const char *) &iov[i], sizeof(iov[i]) }))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+// Part of the output that the transport should copy from a file by itself. It goes after
+// everything queued so far, so that has to be flushed first.
+static int cno_writefile(struct cno_connection_t *c, int fd, uint64_t offset, size_t size) {
+    if (!size)
+        return CNO_OK;
+    return cno_flush(c) || CNO_FIRE(c, on_writefile, fd, offset, size) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+void cno_cork(struct cno_connection_t *c) {
+    c->corked++;
+}
+
+int cno_uncork(struct cno_connection_t *c) {
+    if (!c->corked || --c->corked)
+        return CNO_OK;
+    if (cno_flush(c))
+        return CNO_ERROR_UP();
+    return c->hibernate_when_idle && !c->buffer.size && !(c->stream_count[0] + c->stream_count[1])
+         ? cno_hibernate(c, 0) : CNO_OK;
+}
+
 // Fake http "request" sent by the client at the beginning of a connection.
 static const struct cno_buffer_t CNO_PREFACE = { "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24 };
 
@@ -84,13 +177,195 @@ static const struct cno_settings_t CNO_SETTINGS_INITIAL = {{{
     .max_concurrent_streams = 1024,
     .initial_window_size    = 65535,
     .max_frame_size         = 16384,
-    .max_header_list_size   = -1, // actually (CNO_MAX_CONTINUATIONS * max_frame_size - 32 * CNO_MAX_HEADERS)
+    .max_header_list_size   = 65536,
 }}};
 
 static int cno_stream_is_local(const struct cno_connection_t *c, uint32_t sid) {
     return sid % 2 == c->client;
 }
 
+void cno_stream_pool_init(struct cno_stream_pool_t *pool, size_t limit) {
+    *pool = (struct cno_stream_pool_t) { .limit = limit };
+}
+
+void cno_stream_pool_clear(struct cno_stream_pool_t *pool) {
+    for (struct cno_stream_t *s; (s = pool->free); cno_free(pool->allocator, s, sizeof(struct cno_stream_t)))
+        pool->free = s->next_free;
+    pool->size = 0;
+}
+
+static inline struct cno_stream_pool_t *cno_stream_pool(struct cno_connection_t *c) {
+    return c->stream_pool ? c->stream_pool : &c->stream_pool_own;
+}
+
+static struct cno_stream_t *cno_stream_alloc(struct cno_connection_t *c) {
+    struct cno_stream_pool_t *pool = cno_stream_pool(c);
+    struct cno_stream_t *s = pool->free;
+    if (!s)
+        return cno_alloc(pool->allocator, sizeof(struct cno_stream_t));
+    pool->free = s->next_free;
+    pool->size--;
+    return s;
+}
+
+static void cno_stream_release(struct cno_connection_t *c, struct cno_stream_t *s) {
+    struct cno_stream_pool_t *pool = cno_stream_pool(c);
+    if (pool->size >= pool->limit) {
+        cno_free(pool->allocator, s, sizeof(struct cno_stream_t));
+    } else {
+        s->next_free = pool->free;
+        pool->free = s;
+        pool->size++;
+    }
+}
+
+// The stream table uses open addressing with linear probing, and is kept between 1/8 and 1/2
+// full (except for the minimum size). Since stream ids are sequential, a multiplicative hash
+// spreads them well.
+#define CNO_STREAM_TABLE_MIN_BITS 3
+
+static inline size_t cno_stream_slot(const struct cno_connection_t *c, uint32_t sid) {
+    return (uint32_t) (sid * 0x9E3779B1u) >> (32 - c->stream_table_bits);
+}
+
+static int cno_stream_table_resize(struct cno_connection_t *c, uint8_t bits) {
+    struct cno_stream_t **old = c->streams;
+    size_t n = old ? (size_t) 1 << c->stream_table_bits : 0;
+    struct cno_stream_t **table = cno_alloc(c->allocator, sizeof(struct cno_stream_t *) << bits);
+    if (!table)
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_stream_t *) << bits);
+    memset(table, 0, sizeof(struct cno_stream_t *) << bits);
+    c->streams = table;
+    c->stream_table_bits = bits;
+    for (size_t i = 0; i < n; i++) {
+        if (!old[i])
+            continue;
+        size_t mask = ((size_t) 1 << bits) - 1, j = cno_stream_slot(c, old[i]->id);
+        while (table[j])
+            j = (j + 1) & mask;
+        table[j] = old[i];
+    }
+    cno_free(c->allocator, old, sizeof(struct cno_stream_t *) * n);
+    return CNO_OK;
+}
+
+static int cno_stream_table_insert(struct cno_connection_t *c, struct cno_stream_t *s) {
+    size_t count = c->stream_count[0] + c->stream_count[1];
+    if (!c->streams || (count + 1) * 2 > (size_t) 1 << c->stream_table_bits)
+        if (cno_stream_table_resize(c, c->streams ? c->stream_table_bits + 1 : CNO_STREAM_TABLE_MIN_BITS))
+            return CNO_ERROR_UP();
+    size_t mask = ((size_t) 1 << c->stream_table_bits) - 1, i = cno_stream_slot(c, s->id);
+    while (c->streams[i])
+        i = (i + 1) & mask;
+    c->streams[i] = s;
+    return CNO_OK;
+}
+
+static int cno_stream_table_remove(struct cno_connection_t *c, struct cno_stream_t *s) {
+    size_t mask = ((size_t) 1 << c->stream_table_bits) - 1, i = cno_stream_slot(c, s->id);
+    for (size_t n = mask; c->streams[i] != s; i = (i + 1) & mask)
+        if (!c->streams[i] || !n--)
+            return CNO_ERROR(ASSERTION, "stream %u is not open", s->id);
+    // Shift back the rest of the cluster, unless it would move an entry before its home slot.
+    for (size_t j = (i + 1) & mask; c->streams[j]; j = (j + 1) & mask) {
+        size_t home = cno_stream_slot(c, c->streams[j]->id);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            c->streams[i] = c->streams[j];
+            i = j;
+        }
+    }
+    c->streams[i] = NULL;
+    if (c->stream_last == s)
+        c->stream_last = NULL;
+    return CNO_OK;
+}
+
+// Streams that want to write are kept in one circular list per urgency (RFC 9218). In each,
+// non-incremental streams come first, ordered by id, as they should be sent one at a time;
+// incremental ones follow and take turns.
+#define CNO_DEFAULT_URGENCY 3
+
+static void cno_sched_insert(struct cno_connection_t *c, struct cno_stream_t *s) {
+    struct cno_stream_t *head = c->sched[s->urgency], *pos = head;
+    if (!head) {
+        c->sched[s->urgency] = s->sched_prev = s->sched_next = s;
+        c->sched_mask |= 1u << s->urgency;
+        return;
+    }
+    if (!s->incremental)
+        while (!pos->incremental && pos->id < s->id && (pos = pos->sched_next) != head) {}
+    // Insert before `pos`; if that is the head, this is either the new head or the tail.
+    s->sched_next = pos;
+    s->sched_prev = pos->sched_prev;
+    s->sched_prev->sched_next = s;
+    pos->sched_prev = s;
+    if (!s->incremental && (head->incremental || head->id > s->id))
+        c->sched[s->urgency] = s;
+}
+
+static void cno_sched_remove(struct cno_connection_t *c, struct cno_stream_t *s) {
+    if (!s->sched_next)
+        return;
+    if (s->sched_next == s) {
+        c->sched[s->urgency] = NULL;
+        c->sched_mask &= ~(1u << s->urgency);
+    } else {
+        s->sched_prev->sched_next = s->sched_next;
+        s->sched_next->sched_prev = s->sched_prev;
+        if (c->sched[s->urgency] == s)
+            c->sched[s->urgency] = s->sched_next;
+    }
+    s->sched_prev = s->sched_next = NULL;
+}
+
+// Called after writing DATA: an incremental stream that got its turn goes to the back of the line.
+static void cno_sched_rotate(struct cno_connection_t *c, struct cno_stream_t *s) {
+    if (s->incremental && s->sched_next) {
+        cno_sched_remove(c, s);
+        cno_sched_insert(c, s);
+    }
+}
+
+static void cno_sched_set_priority(struct cno_connection_t *c, struct cno_stream_t *s, uint8_t urgency, uint8_t incremental) {
+    int waiting = !!s->sched_next;
+    cno_sched_remove(c, s);
+    s->urgency = urgency;
+    s->incremental = incremental;
+    if (waiting)
+        cno_sched_insert(c, s);
+}
+
+// Parse the value of a `priority` header or PRIORITY_UPDATE, a structured field dictionary
+// (RFC 8941) with an integer `u` and a boolean `i`. Unknown or invalid members are ignored.
+static void cno_priority_parse(struct cno_connection_t *c, struct cno_stream_t *s, struct cno_buffer_t v) {
+    uint8_t urgency = CNO_DEFAULT_URGENCY, incremental = 0;
+    for (const char *p = v.data, *e = p + v.size; p < e;) {
+        while (p < e && (*p == ' ' || *p == '\t'))
+            p++;
+        const char *m = p;
+        while (p < e && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        if (p - m == 3 && m[0] == 'u' && m[1] == '=' && '0' <= m[2] && m[2] <= '7')
+            urgency = m[2] - '0';
+        else if (p - m == 1 && m[0] == 'i')
+            incremental = 1;
+        else if (p - m == 4 && m[0] == 'i' && m[1] == '=' && m[2] == '?' && (m[3] == '0' || m[3] == '1'))
+            incremental = m[3] == '1';
+        // Skip parameters, if any.
+        while (p < e && *p++ != ',') {}
+    }
+    c->priority_rfc9218 = 1;
+    cno_sched_set_priority(c, s, urgency, incremental);
+}
+
+// An RFC 7540 weight (sent as weight - 1) as an urgency, on a log scale so that the default
+// weight of 16 means the default urgency: 1 -> 7, 2..3 -> 6, ..., 16..31 -> 3, ..., 128..256 -> 0.
+#define CNO_PRIORITY_WEIGHT_URGENCY(w) \
+    ((w) < 1 ? 7 : (w) < 3 ? 6 : (w) < 7 ? 5 : (w) < 15 ? 4 : (w) < 31 ? 3 : (w) < 63 ? 2 : (w) < 127 ? 1 : 0)
+
+_Static_assert(CNO_PRIORITY_WEIGHT_URGENCY(15) == CNO_DEFAULT_URGENCY, "default weight must be default urgency");
+_Static_assert(CNO_PRIORITY_WEIGHT_URGENCY(0) == 7 && CNO_PRIORITY_WEIGHT_URGENCY(255) == 0, "must span all urgencies");
+
 static struct cno_stream_t * cno_stream_new(struct cno_connection_t *c, uint32_t sid, int local) {
     if (cno_stream_is_local(c, sid) != local)
         return (local ? CNO_ERROR(INVALID_STREAM, "incorrect stream id parity")
@@ -105,43 +380,92 @@ static struct cno_stream_t * cno_stream_new(struct cno_connection_t *c, uint32_t
         return (local ? CNO_ERROR(WOULD_BLOCK, "wait for on_stream_end")
                       : CNO_ERROR(PROTOCOL, "peer exceeded stream limit")), NULL;
 
-    struct cno_stream_t *s = malloc(sizeof(struct cno_stream_t));
+    struct cno_stream_t *s = cno_stream_alloc(c);
     if (!s)
         return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_stream_t)), NULL;
     *s = (struct cno_stream_t) {
-        .id     = c->last_stream[local] = sid,
-        .next   = c->streams[sid % CNO_STREAM_BUCKETS],
+        .id     = sid,
         .r_state = sid % 2 || !local ? CNO_STREAM_HEADERS : CNO_STREAM_CLOSED,
         .w_state = sid % 2 ||  local ? CNO_STREAM_HEADERS : CNO_STREAM_CLOSED,
+        .urgency = CNO_DEFAULT_URGENCY,
     };
+    if (cno_stream_table_insert(c, s))
+        return cno_stream_release(c, s), (void)CNO_ERROR_UP(), NULL;
 
-    // Gotta love C for not having any standard library to speak of.
-    c->streams[sid % CNO_STREAM_BUCKETS] = s;
+    c->last_stream[local] = sid;
     c->stream_count[local]++;
+    c->stream_last = s;
 
     if (CNO_FIRE(c, on_stream_start, sid)) {
-        c->streams[sid % CNO_STREAM_BUCKETS] = s->next;
+        (void) cno_stream_table_remove(c, s); // was just inserted, so is certainly there
         c->stream_count[local]--;
-        free(s);
+        cno_stream_release(c, s);
         return (void)CNO_ERROR_UP(), NULL;
     }
     return s;
 }
 
-static struct cno_stream_t *cno_stream_find(const struct cno_connection_t *c, uint32_t sid) {
-    struct cno_stream_t *s = c->streams[sid % CNO_STREAM_BUCKETS];
-    while (s && s->id != sid) s = s->next;
-    return s;
+static struct cno_stream_t *cno_stream_find(struct cno_connection_t *c, uint32_t sid) {
+    // Consecutive frames tend to be on the same stream.
+    if (c->stream_last && c->stream_last->id == sid)
+        return c->stream_last;
+    if (!c->streams)
+        return NULL;
+    size_t mask = ((size_t) 1 << c->stream_table_bits) - 1, i = cno_stream_slot(c, sid);
+    struct cno_stream_t *s;
+    while ((s = c->streams[i]) && s->id != sid)
+        i = (i + 1) & mask;
+    return s ? (c->stream_last = s) : NULL;
+}
+
+// Give back all unsent buffers. Keeps going if a callback fails, as the rest must be released anyway.
+static int cno_queue_release(struct cno_connection_t *c, struct cno_buffer_dyn_t *queue) {
+    int ret = CNO_OK;
+    const struct cno_queued_t *it = (const struct cno_queued_t *) queue->data;
+    for (size_t n = queue->size / sizeof(struct cno_queued_t); n--; it++)
+        if (CNO_FIRE(c, on_data_release, it->token))
+            ret = CNO_ERROR_UP();
+    cno_buffer_dyn_clear_with(c->allocator, queue);
+    return ret;
 }
 
 static int cno_stream_end(struct cno_connection_t *c, struct cno_stream_t *s) {
     uint32_t sid = s->id;
-    struct cno_stream_t **sp = &c->streams[sid % CNO_STREAM_BUCKETS];
-    while (*sp != s) sp = &(*sp)->next;
-    *sp = s->next;
-    free(s);
-    c->stream_count[cno_stream_is_local(c, sid)]--;
-    return CNO_FIRE(c, on_stream_end, sid);
+    void *data = s->data;
+    struct cno_buffer_dyn_t queue = s->send_queue;
+    if (cno_stream_table_remove(c, s))
+        return CNO_ERROR_UP();
+    cno_sched_remove(c, s);
+    cno_stream_release(c, s);
+    size_t count = --c->stream_count[cno_stream_is_local(c, sid)] + c->stream_count[!cno_stream_is_local(c, sid)];
+    if (c->stream_table_bits > CNO_STREAM_TABLE_MIN_BITS && count * 8 < (size_t) 1 << c->stream_table_bits)
+        // Not a problem if this fails, the table is simply bigger than it needs to be.
+        (void) cno_stream_table_resize(c, c->stream_table_bits - 1);
+    if (cno_queue_release(c, &queue))
+        return CNO_ERROR_UP();
+    return c->cb_code && c->cb_code->on_stream_close ? CNO_FIRE(c, on_stream_close, sid, data)
+                                                     : CNO_FIRE(c, on_stream_end, sid);
+}
+
+static int cno_stream_fire_data(struct cno_connection_t *c, struct cno_stream_t *s, const char *data, size_t size) {
+    return c->cb_code && c->cb_code->on_stream_data ? CNO_FIRE(c, on_stream_data, s, s->data, data, size)
+                                                    : CNO_FIRE(c, on_message_data, s->id, data, size);
+}
+
+struct cno_stream_t *cno_stream_get(struct cno_connection_t *c, uint32_t sid) {
+    return cno_stream_find(c, sid);
+}
+
+uint32_t cno_stream_id(const struct cno_stream_t *s) {
+    return s->id;
+}
+
+void *cno_stream_data(const struct cno_stream_t *s) {
+    return s->data;
+}
+
+void cno_stream_set_data(struct cno_stream_t *s, void *data) {
+    s->data = data;
 }
 
 static int cno_stream_end_by_local(struct cno_connection_t *c, struct cno_stream_t *s) {
@@ -194,6 +518,81 @@ static int cno_frame_write(struct cno_connection_t *c, const struct cno_frame_t
     return cno_frame_write(c, &part);
 }
 
+// Give back `delta` bytes of a receive window (of stream `sid`, or the connection if 0),
+// but only tell the peer once enough has accumulated to make a WINDOW_UPDATE worthwhile.
+static int cno_flow_credit(struct cno_connection_t *c, uint32_t sid, int64_t *window, uint32_t *pending,
+                           uint32_t delta, uint32_t size)
+{
+    // Above 100%, the window would run out before an update is due.
+    uint32_t percent = c->window_update_percent < 100 ? c->window_update_percent : 100;
+    if ((*pending += delta) == 0 || (uint64_t) *pending * 100 < (uint64_t) size * percent)
+        return CNO_OK;
+    struct cno_frame_t update = { CNO_FRAME_WINDOW_UPDATE, 0, sid, PACK(I32(*pending)) };
+    *window += *pending;
+    *pending = 0;
+    return cno_frame_write(c, &update);
+}
+
+// Streams that auto-tuning has made bigger since they were last refilled get the difference
+// along with the credit, so only the ones that are receiving anything are updated.
+static int cno_stream_flow_credit(struct cno_connection_t *c, struct cno_stream_t *s, uint32_t delta) {
+    uint32_t grow = c->window_stream_grown - s->window_recv_grown;
+    s->window_recv_grown = c->window_stream_grown;
+    return cno_flow_credit(c, s->id, &s->window_recv, &s->window_recv_pending, delta + grow,
+                           c->settings[CNO_LOCAL].initial_window_size + c->window_stream_grown);
+}
+
+// Make the connection's receive window bigger, both now and as the target for refills.
+static int cno_flow_grow(struct cno_connection_t *c, uint32_t delta) {
+    if (delta > 0x7FFFFFFFu - c->window_recv_size)
+        delta = 0x7FFFFFFFu - c->window_recv_size;
+    if (!delta)
+        return CNO_OK;
+    c->window_recv_size += delta;
+    c->window_recv += delta;
+    return cno_frame_write(c, &(struct cno_frame_t) { CNO_FRAME_WINDOW_UPDATE, 0, 0, PACK(I32(delta)) });
+}
+
+// The number of bytes received between sending a PING and getting it back is the amount
+// in flight over one round trip. If that is close to the window size, it's the window that
+// limits throughput rather than the link, so it should be bigger.
+static const char CNO_BDP_PING[8] = "cno-bdp";
+
+static int cno_bdp_sample(struct cno_connection_t *c, uint32_t flow) {
+    if (c->bdp_pinging)
+        return c->bdp_bytes += flow, CNO_OK;
+    if (c->window_recv_size >= c->window_autotune_limit
+     && c->settings[CNO_LOCAL].initial_window_size + c->window_stream_grown >= c->window_autotune_limit / 2)
+        return CNO_OK;
+    // The frame that triggered the PING is part of what is in flight.
+    c->bdp_pinging = 1;
+    c->bdp_bytes = flow;
+    return cno_frame_write(c, &(struct cno_frame_t) { CNO_FRAME_PING, 0, 0, { CNO_BDP_PING, 8 } });
+}
+
+static int cno_bdp_update(struct cno_connection_t *c) {
+    c->bdp_pinging = 0;
+    // Either window may be what is limiting throughput; a single stream cannot go faster
+    // than its own allows even if the connection's is much bigger.
+    uint32_t stream = c->settings[CNO_LOCAL].initial_window_size + c->window_stream_grown;
+    uint32_t limiting = stream < c->window_recv_size ? stream : c->window_recv_size;
+    if ((uint64_t) c->bdp_bytes * 3 < (uint64_t) limiting * 2)
+        return CNO_OK;
+    uint64_t size = (uint64_t) c->bdp_bytes * 2;
+    // A stream may use at most half of the connection's window, so that one that is not being
+    // read cannot stall all the others. Stream windows are raised with their next WINDOW_UPDATE
+    // (see `cno_stream_flow_credit`) rather than with SETTINGS, which would grant it to every
+    // stream at once.
+    uint64_t stream_size = size < c->window_autotune_limit / 2 ? size : c->window_autotune_limit / 2;
+    if (stream_size > stream)
+        c->window_stream_grown += stream_size - stream;
+    if (size < stream_size * 2)
+        size = stream_size * 2;
+    if (size > c->window_autotune_limit)
+        size = c->window_autotune_limit;
+    return size > c->window_recv_size ? cno_flow_grow(c, size - c->window_recv_size) : CNO_OK;
+}
+
 static int cno_frame_write_goaway(struct cno_connection_t *c, uint32_t /* enum CNO_RST_STREAM_CODE */ code) {
     if (!c->goaway_sent)
         c->goaway_sent = c->last_stream[CNO_REMOTE];
@@ -252,8 +651,13 @@ static int cno_frame_handle_end_stream(struct cno_connection_t *c,
 {
     if (!s->reading_head_response && s->remaining_payload && s->remaining_payload != (uint64_t) -1)
         return cno_frame_write_rst_stream(c, s, CNO_RST_PROTOCOL_ERROR);
-    if (CNO_FIRE(c, on_message_tail, s->id, trailers))
+    uint32_t sid = s->id;
+    s->end_received = 1;
+    if (CNO_FIRE(c, on_message_tail, sid, trailers))
         return CNO_ERROR_UP();
+    // The callback may have ended the stream, e.g. by sending a final response.
+    if (!(s = cno_stream_find(c, sid)))
+        return CNO_OK;
     s->r_state = CNO_STREAM_CLOSED;
     return s->w_state == CNO_STREAM_CLOSED ? cno_stream_end(c, s) : CNO_OK;
 }
@@ -365,6 +769,11 @@ static int cno_frame_handle_message(struct cno_connection_t *c,
         if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("content-length")))
             if ((s->remaining_payload = cno_parse_uint(it->value)) == (uint64_t) -1)
                 return cno_frame_write_rst_stream(c, s, CNO_RST_PROTOCOL_ERROR);
+
+        // Only in the request head; trailers come too late to change anything.
+        if (!c->client && s->r_state == CNO_STREAM_HEADERS
+         && cno_buffer_eq(it->name, CNO_BUFFER_STRING("priority")))
+            cno_priority_parse(c, s, it->value);
     }
 
     if (s->r_state != CNO_STREAM_HEADERS)
@@ -385,37 +794,89 @@ static int cno_frame_handle_message(struct cno_connection_t *c,
     else if (f->flags & CNO_FLAG_END_STREAM || s->remaining_payload != (uint64_t) -1)
         return cno_frame_write_rst_stream(c, s, CNO_RST_PROTOCOL_ERROR);
 
-    if (CNO_FIRE(c, on_message_head, s->id, m))
+    uint32_t sid = s->id;
+    s->end_received = !!(f->flags & CNO_FLAG_END_STREAM);
+    if (CNO_FIRE(c, on_message_head, sid, m))
         return CNO_ERROR_UP();
 
-    if (f->flags & CNO_FLAG_END_STREAM)
+    // The callback may have ended the stream, e.g. by sending a final response.
+    if (f->flags & CNO_FLAG_END_STREAM && (s = cno_stream_find(c, sid)) != NULL)
         return cno_frame_handle_end_stream(c, s, NULL);
 
     return CNO_OK;
 }
 
-static int cno_frame_handle_end_headers(struct cno_connection_t *c,
-                                        struct cno_stream_t     *s,
-                                        struct cno_frame_t      *f)
-{
-    if (!(f->flags & CNO_FLAG_END_HEADERS))
-        return CNO_ERROR(ASSERTION, "HEADERS/PUSH_PROMISE not merged with CONTINUATION");
+static void cno_frame_reset_header_block(struct cno_connection_t *c) {
+    struct cno_header_t *it = (struct cno_header_t *) c->headers.data;
+    for (struct cno_header_t *end = it + c->headers.size / sizeof(*it); it != end; it++)
+        cno_hpack_free_header_with(c->decoder.allocator, it);
+    c->headers.size = 0;
+    c->decoded.size = 0;
+    c->fragment.size = 0;
+    c->continued = (struct cno_frame_t) {};
+}
 
-    struct cno_header_t headers[CNO_MAX_HEADERS];
-    struct cno_message_t m = { 0, {}, {}, headers, CNO_MAX_HEADERS };
-    if (cno_hpack_decode(&c->decoder, f->payload, headers, &m.headers_len)) {
+// Decode a HEADERS, PUSH_PROMISE, or CONTINUATION payload, then handle the message if
+// this was the last one.
+static int cno_frame_handle_header_fragment(struct cno_connection_t *c, struct cno_frame_t *f) {
+    // Literal headers take no more space on the wire than they are counted as below, so this
+    // is no stricter than that check. Frame headers are included to make empty CONTINUATIONs
+    // count towards the limit too.
+    if ((c->continued_wire += f->payload.size + 9) > c->settings[CNO_LOCAL].max_header_list_size)
+        return cno_frame_reset_header_block(c), cno_frame_write_error(c, CNO_RST_ENHANCE_YOUR_CALM, "header block too big");
+    // Only a header split between frames is copied; everything else is decoded in place.
+    struct cno_buffer_t buf = f->payload;
+    if (c->fragment.size) {
+        if (cno_buffer_dyn_concat_with(c->allocator, &c->fragment, f->payload))
+            return cno_frame_reset_header_block(c), CNO_ERROR_UP();
+        buf = CNO_BUFFER_VIEW(c->fragment);
+    }
+
+    const size_t before = c->headers.size / sizeof(struct cno_header_t);
+    if (cno_hpack_decode_fragment(&c->decoder, &c->decoded, &c->headers, &buf)
+     || (f->flags & CNO_FLAG_END_HEADERS && buf.size && CNO_ERROR(PROTOCOL, "truncated header block"))) {
+        cno_frame_reset_header_block(c);
         cno_frame_write_goaway(c, CNO_RST_COMPRESSION_ERROR);
         return CNO_ERROR_UP();
     }
 
-    const size_t nheaders = m.headers_len;
+    struct cno_header_t *headers = (struct cno_header_t *) c->headers.data;
+    const size_t nheaders = c->headers.size / sizeof(struct cno_header_t);
+    for (size_t i = before; i < nheaders; i++)
+        c->continued_size += headers[i].name.size + headers[i].value.size + 32;
+    if (c->continued_size > c->settings[CNO_LOCAL].max_header_list_size)
+        return cno_frame_reset_header_block(c), cno_frame_write_error(c, CNO_RST_ENHANCE_YOUR_CALM, "header list too big");
+
+    if (c->fragment.size)
+        cno_buffer_dyn_shift(&c->fragment, c->fragment.size - buf.size);
+    else if (cno_buffer_dyn_concat_with(c->allocator, &c->fragment, buf))
+        return cno_frame_reset_header_block(c), CNO_ERROR_UP();
+
+    if (!(f->flags & CNO_FLAG_END_HEADERS))
+        return CNO_OK;
+
+    struct cno_frame_t head = c->continued;
+    head.flags |= CNO_FLAG_END_HEADERS;
+    struct cno_message_t m = { 0, {}, {}, headers, nheaders };
     // Just ignore the message if the stream has already been reset.
-    int ret = s ? cno_frame_handle_message(c, s, f, &m) : CNO_OK;
-    for (size_t i = 0; i < nheaders; i++)
-        cno_hpack_free_header(&headers[i]);
+    struct cno_stream_t *s = c->continued_target ? cno_stream_find(c, c->continued_target) : NULL;
+    c->continued.stream = 0;
+    int ret = s ? cno_frame_handle_message(c, s, &head, &m) : CNO_OK;
+    cno_frame_reset_header_block(c);
     return ret;
 }
 
+static int cno_frame_handle_header_block(struct cno_connection_t *c,
+                                        struct cno_stream_t     *s,
+                                        struct cno_frame_t      *f)
+{
+    c->continued = (struct cno_frame_t) { f->type, f->flags, f->stream, {} };
+    c->continued_target = s ? s->id : 0;
+    c->continued_wire = 0;
+    c->continued_size = 0;
+    return cno_frame_handle_header_fragment(c, f);
+}
+
 static int cno_frame_handle_padding(struct cno_connection_t *c, struct cno_frame_t *f) {
     if (f->flags & CNO_FLAG_PADDED) {
         if (f->payload.size == 0)
@@ -448,12 +909,27 @@ static int cno_frame_handle_priority(struct cno_connection_t *c,
             return s ? cno_frame_write_rst_stream(c, s, CNO_RST_PROTOCOL_ERROR)
                      : cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "PRIORITY depends on itself");
 
-        // TODO implement prioritization
+        // Dependencies are ignored; the weight is used as an urgency unless the peer
+        // has shown that it knows about RFC 9218.
+        if (s && !c->priority_rfc9218)
+            cno_sched_set_priority(c, s, CNO_PRIORITY_WEIGHT_URGENCY((uint8_t) f->payload.data[4]), s->incremental);
         f->payload = cno_buffer_shift(f->payload, 5);
     }
     return CNO_OK;
 }
 
+static int cno_frame_handle_priority_update(struct cno_connection_t *c, struct cno_frame_t *f) {
+    if (c->client || f->stream)
+        return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "unexpected PRIORITY_UPDATE");
+    if (f->payload.size < 4)
+        return cno_frame_write_error(c, CNO_RST_FRAME_SIZE_ERROR, "PRIORITY_UPDATE too short");
+    // Updates for streams that are not open yet should be remembered, but aren't.
+    struct cno_stream_t *s = cno_stream_find(c, read4(f->payload.data) & 0x7FFFFFFFUL);
+    if (s)
+        cno_priority_parse(c, s, cno_buffer_shift(f->payload, 4));
+    return CNO_OK;
+}
+
 static int cno_frame_handle_headers(struct cno_connection_t *c,
                                     struct cno_stream_t     *s,
                                     struct cno_frame_t      *f)
@@ -461,6 +937,8 @@ static int cno_frame_handle_headers(struct cno_connection_t *c,
     if (cno_frame_handle_padding(c, f))
         return CNO_ERROR_UP();
 
+    // The stream may not exist yet, in which case it has to be prioritized after creation.
+    uint8_t weight = f->flags & CNO_FLAG_PRIORITY && f->payload.size >= 5 ? f->payload.data[4] : 0;
     if (cno_frame_handle_priority(c, s, f))
         return CNO_ERROR_UP();
 
@@ -476,6 +954,8 @@ static int cno_frame_handle_headers(struct cno_connection_t *c,
             s = cno_stream_new(c, f->stream, CNO_REMOTE);
             if (s == NULL)
                 return CNO_ERROR_UP();
+            if (f->flags & CNO_FLAG_PRIORITY && !c->priority_rfc9218)
+                cno_sched_set_priority(c, s, CNO_PRIORITY_WEIGHT_URGENCY(weight), 0);
         }
     } else if (s->r_state == CNO_STREAM_DATA) {
         if (!(f->flags & CNO_FLAG_END_STREAM))
@@ -484,7 +964,7 @@ static int cno_frame_handle_headers(struct cno_connection_t *c,
         return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "unexpected HEADERS");
     }
 
-    return cno_frame_handle_end_headers(c, s, f);
+    return cno_frame_handle_header_block(c, s, f);
 }
 
 static int cno_frame_handle_push_promise(struct cno_connection_t *c,
@@ -506,17 +986,24 @@ static int cno_frame_handle_push_promise(struct cno_connection_t *c,
     if (child == NULL)
         return CNO_ERROR_UP();
     f->payload = cno_buffer_shift(f->payload, 4);
-    return cno_frame_handle_end_headers(c, child, f);
+    return cno_frame_handle_header_block(c, child, f);
 }
 
 static int cno_frame_handle_continuation(struct cno_connection_t *c,
                                          struct cno_stream_t     *s __attribute__((unused)),
-                                         struct cno_frame_t      *f __attribute__((unused)))
+                                         struct cno_frame_t      *f)
 {
-    // There were no HEADERS (else `cno_when_h2_frame` would've merge the frames).
-    return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "unexpected CONTINUATION");
+    // `cno_when_h2_frame` has already checked that this is the expected stream.
+    if (!c->continued.stream)
+        return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "unexpected CONTINUATION");
+    if (f->flags & ~CNO_FLAG_END_HEADERS)
+        return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "invalid CONTINUATION flags");
+    return cno_frame_handle_header_fragment(c, f);
 }
 
+// Only the header (and the padding length) of the frame has been received at this point;
+// everything is checked and accounted for based on that. The payload is then passed on
+// piece by piece by `cno_when_h2_data` as it arrives.
 static int cno_frame_handle_data(struct cno_connection_t *c,
                                  struct cno_stream_t     *s,
                                  struct cno_frame_t      *f)
@@ -526,9 +1013,24 @@ static int cno_frame_handle_data(struct cno_connection_t *c,
     if (cno_frame_handle_padding(c, f))
         return CNO_ERROR_UP();
 
+    // Unless it's delivered to the stream, the payload is skipped.
+    c->data_stream  = 0;
+    c->data_flags   = f->flags;
+    c->data_left    = f->payload.size;
+    c->data_padding = flow - f->payload.size - !!(f->flags & CNO_FLAG_PADDED);
+
     // Frames on invalid streams still count against the connection-wide flow control window.
-    // TODO allow manual connection flow control?
-    if (flow && cno_frame_write(c, &(struct cno_frame_t) { CNO_FRAME_WINDOW_UPDATE, 0, 0, PACK(I32(flow)) }))
+    if (flow > c->window_recv)
+        return cno_frame_write_error(c, CNO_RST_FLOW_CONTROL_ERROR, "connection window exceeded");
+    c->window_recv -= flow;
+    if (c->window_autotune_limit && cno_bdp_sample(c, flow))
+        return CNO_ERROR_UP();
+
+    int deliver = s && s->r_state == CNO_STREAM_DATA
+               && (!flow || flow <= s->window_recv + c->settings[CNO_LOCAL].initial_window_size);
+    // The application can only give back what it has seen; the rest is returned right away.
+    uint32_t seen = deliver && c->manual_connection_flow_control ? f->payload.size : 0;
+    if (cno_flow_credit(c, 0, &c->window_recv, &c->window_recv_pending, flow - seen, c->window_recv_size))
         return CNO_ERROR_UP();
 
     if (!s)
@@ -537,26 +1039,17 @@ static int cno_frame_handle_data(struct cno_connection_t *c,
     if (s->r_state != CNO_STREAM_DATA)
         return cno_frame_write_rst_stream(c, s, CNO_RST_STREAM_CLOSED);
 
-    if (flow && flow > s->window_recv + c->settings[CNO_LOCAL].initial_window_size)
+    if (!deliver)
         return cno_frame_write_rst_stream(c, s, CNO_RST_FLOW_CONTROL_ERROR);
+    s->window_recv -= flow;
 
     if (s->remaining_payload != (uint64_t) -1)
         s->remaining_payload -= f->payload.size;
 
-    if (f->payload.size && CNO_FIRE(c, on_message_data, f->stream, f->payload.data, f->payload.size))
-        return CNO_ERROR_UP();
-
-    if (f->flags & CNO_FLAG_END_STREAM)
-        return cno_frame_handle_end_stream(c, s, NULL);
-
-    if (c->manual_flow_control) {
-        s->window_recv -= f->payload.size;
-        // If there was padding, increase the window by its length right now anyway.
-        flow -= f->payload.size;
-    }
-
-    struct cno_frame_t update = { CNO_FRAME_WINDOW_UPDATE, 0, s->id, PACK(I32(flow)) };
-    return flow ? cno_frame_write(c, &update) : CNO_OK;
+    // If there was padding, increase the window by its length anyway.
+    c->data_stream = s->id;
+    c->data_credit = c->manual_flow_control ? flow - f->payload.size : flow;
+    return CNO_OK;
 }
 
 static int cno_frame_handle_ping(struct cno_connection_t *c,
@@ -570,7 +1063,8 @@ static int cno_frame_handle_ping(struct cno_connection_t *c,
         return cno_frame_write_error(c, CNO_RST_FRAME_SIZE_ERROR, "bad PING frame");
 
     if (f->flags & CNO_FLAG_ACK)
-        return CNO_FIRE(c, on_pong, f->payload.data);
+        return c->bdp_pinging && !memcmp(f->payload.data, CNO_BDP_PING, 8) ? cno_bdp_update(c)
+             : CNO_FIRE(c, on_pong, f->payload.data);
 
     struct cno_frame_t response = { CNO_FRAME_PING, CNO_FLAG_ACK, 0, f->payload };
     return cno_frame_write(c, &response);
@@ -607,6 +1101,9 @@ static int cno_frame_handle_rst_stream(struct cno_connection_t *c,
     return cno_stream_end(c, s);
 }
 
+// Defined next to `cno_queue_data`; called when a flow control window opens.
+static int cno_send_queued(struct cno_connection_t *c);
+
 static int cno_frame_handle_settings(struct cno_connection_t *c,
                                      struct cno_stream_t     *s __attribute__((unused)),
                                      struct cno_frame_t      *f)
@@ -642,12 +1139,12 @@ static int cno_frame_handle_settings(struct cno_connection_t *c,
     if (cfg->max_frame_size < 16384 || cfg->max_frame_size > 16777215)
         return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "max_frame_size out of bounds");
 
-    if (cfg->initial_window_size > old_window && CNO_FIRE(c, on_flow_increase, 0))
+    if (cfg->initial_window_size > old_window && (cno_send_queued(c) || CNO_FIRE(c, on_flow_increase, 0)))
         return CNO_ERROR_UP();
 
     size_t limit = c->encoder.limit_upper = cfg->header_table_size;
-    if (limit > c->settings[CNO_LOCAL].header_table_size)
-        limit = c->settings[CNO_LOCAL].header_table_size;
+    if (limit > c->encoder_table_size)
+        limit = c->encoder_table_size;
     if (cno_hpack_setlimit(&c->encoder, limit))
         return CNO_ERROR_UP();
 
@@ -673,10 +1170,17 @@ static int cno_frame_handle_window_update(struct cno_connection_t *c,
         if ((s->window_send += delta) + c->settings[CNO_REMOTE].initial_window_size > 0x7FFFFFFFL)
             return cno_frame_write_rst_stream(c, s, CNO_RST_FLOW_CONTROL_ERROR);
     } else {
-        return cno_frame_handle_invalid_stream(c, f);
+        // >WINDOW_UPDATE or RST_STREAM frames can be received in this state for a short
+        // >period after a DATA or HEADERS frame containing an END_STREAM flag is sent.
+        // >Until the remote peer receives and processes RST_STREAM or the frame bearing
+        // >the END_STREAM flag, it might send frames of these types. Endpoints MUST ignore
+        // >WINDOW_UPDATE or RST_STREAM frames received in this state [...]
+        // `cno_frame_handle_invalid_stream` only remembers streams that we reset ourselves.
+        return f->stream <= c->last_stream[cno_stream_is_local(c, f->stream)] ? CNO_OK
+             : cno_frame_handle_invalid_stream(c, f);
     }
 
-    return CNO_FIRE(c, on_flow_increase, f->stream);
+    return cno_send_queued(c) || CNO_FIRE(c, on_flow_increase, f->stream) ? CNO_ERROR_UP() : CNO_OK;
 }
 
 typedef int cno_frame_handler_t(struct cno_connection_t *,
@@ -685,7 +1189,7 @@ typedef int cno_frame_handler_t(struct cno_connection_t *,
 
 static cno_frame_handler_t * const CNO_FRAME_HANDLERS[] = {
     // Should be synced to enum CNO_FRAME_TYPE.
-    &cno_frame_handle_data,
+    NULL, // DATA, see `cno_when_h2_frame`
     &cno_frame_handle_headers,
     &cno_frame_handle_priority,
     &cno_frame_handle_rst_stream,
@@ -718,10 +1222,14 @@ void cno_init(struct cno_connection_t *c, enum CNO_CONNECTION_KIND kind) {
     *c = (struct cno_connection_t) {
         .client      = CNO_CLIENT == kind,
         .window_recv = CNO_SETTINGS_STANDARD.initial_window_size,
+        .window_recv_size = CNO_SETTINGS_STANDARD.initial_window_size,
         .window_send = CNO_SETTINGS_STANDARD.initial_window_size,
         .settings    = { /* remote = */ CNO_SETTINGS_CONSERVATIVE,
                          /* local  = */ CNO_SETTINGS_INITIAL, },
         .disallow_h2_upgrade = 1,
+        .encoder_table_size  = CNO_SETTINGS_STANDARD.header_table_size,
+        .window_update_percent = 50,
+        .stream_pool_own = { .limit = CNO_STREAM_POOL_LIMIT },
     };
 
     cno_hpack_init(&c->decoder, CNO_SETTINGS_INITIAL .header_table_size);
@@ -729,13 +1237,76 @@ void cno_init(struct cno_connection_t *c, enum CNO_CONNECTION_KIND kind) {
 }
 
 void cno_fini(struct cno_connection_t *c) {
-    cno_buffer_dyn_clear(&c->buffer);
+    cno_frame_reset_header_block(c);
+    cno_buffer_dyn_clear_with(c->allocator, &c->buffer);
+    cno_buffer_dyn_clear_with(c->allocator, &c->decoded);
+    cno_buffer_dyn_clear_with(c->allocator, &c->headers);
+    cno_buffer_dyn_clear_with(c->allocator, &c->fragment);
+    cno_buffer_dyn_clear_with(c->allocator, &c->cork_iov);
+    cno_buffer_dyn_clear_with(c->allocator, &c->cork_data);
+    cno_buffer_dyn_clear_with(c->allocator, &c->coalesced);
+    cno_buffer_dyn_clear_with(c->allocator, &c->coalesced_copy);
     cno_hpack_clear(&c->encoder);
     cno_hpack_clear(&c->decoder);
 
-    for (size_t i = 0; i < CNO_STREAM_BUCKETS; i++)
-        for (struct cno_stream_t *s; (s = c->streams[i]); free(s))
-            c->streams[i] = s->next;
+    for (size_t i = 0; c->streams && i < (size_t) 1 << c->stream_table_bits; i++) {
+        if (c->streams[i]) {
+            (void) cno_queue_release(c, &c->streams[i]->send_queue);
+            cno_stream_release(c, c->streams[i]);
+        }
+    }
+    cno_free(c->allocator, c->streams, sizeof(struct cno_stream_t *) << c->stream_table_bits);
+    cno_stream_pool_clear(&c->stream_pool_own);
+    c->streams = NULL;
+    c->stream_last = NULL;
+}
+
+int cno_hibernate(struct cno_connection_t *c, int hpack) {
+    if (c->corked)
+        return CNO_ERROR(ASSERTION, "cannot hibernate while corked");
+    if (!c->buffer.size)
+        cno_buffer_dyn_clear_with(c->allocator, &c->buffer);
+    if (!c->continued.stream) {
+        cno_buffer_dyn_clear_with(c->allocator, &c->decoded);
+        cno_buffer_dyn_clear_with(c->allocator, &c->headers);
+        cno_buffer_dyn_clear_with(c->allocator, &c->fragment);
+    }
+    // These are only non-empty while a call is in progress.
+    cno_buffer_dyn_clear_with(c->allocator, &c->cork_iov);
+    cno_buffer_dyn_clear_with(c->allocator, &c->cork_data);
+    cno_buffer_dyn_clear_with(c->allocator, &c->coalesced);
+    cno_buffer_dyn_clear_with(c->allocator, &c->coalesced_copy);
+    cno_stream_pool_clear(&c->stream_pool_own);
+    if (!(c->stream_count[0] + c->stream_count[1])) {
+        // `cno_stream_table_insert` will allocate a new one.
+        cno_free(c->allocator, c->streams, sizeof(struct cno_stream_t *) << c->stream_table_bits);
+        c->streams = NULL;
+        c->stream_last = NULL;
+    }
+    return hpack && (cno_hpack_compact(&c->encoder) || cno_hpack_compact(&c->decoder)) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+static inline size_t cno_buffer_dyn_allocated(const struct cno_buffer_dyn_t *x) {
+    return x->data ? x->cap + x->offset : 0;
+}
+
+void cno_memory_usage(const struct cno_connection_t *c, struct cno_memory_usage_t *u) {
+    *u = (struct cno_memory_usage_t) {
+        .connection  = sizeof(struct cno_connection_t),
+        .buffers     = cno_buffer_dyn_allocated(&c->buffer) + cno_buffer_dyn_allocated(&c->decoded)
+                     + cno_buffer_dyn_allocated(&c->headers) + cno_buffer_dyn_allocated(&c->fragment)
+                     + cno_buffer_dyn_allocated(&c->cork_iov) + cno_buffer_dyn_allocated(&c->cork_data)
+                     + cno_buffer_dyn_allocated(&c->coalesced) + cno_buffer_dyn_allocated(&c->coalesced_copy),
+        .stream_pool = sizeof(struct cno_stream_t) * c->stream_pool_own.size,
+        .encoder     = cno_hpack_memory_usage(&c->encoder),
+        .decoder     = cno_hpack_memory_usage(&c->decoder),
+    };
+    for (size_t i = 0; c->streams && i < (size_t) 1 << c->stream_table_bits; i++)
+        if (c->streams[i])
+            u->streams += sizeof(struct cno_stream_t) + cno_buffer_dyn_allocated(&c->streams[i]->send_queue);
+    if (c->streams)
+        u->streams += sizeof(struct cno_stream_t *) << c->stream_table_bits;
+    u->total = u->connection + u->buffers + u->streams + u->stream_pool + u->encoder + u->decoder;
 }
 
 static size_t cno_remove_chunked_te(struct cno_buffer_t *buf) {
@@ -758,7 +1329,7 @@ static int cno_when_closed(struct cno_connection_t *c __attribute__((unused))) {
 
 static int cno_when_h2_init(struct cno_connection_t *c) {
     c->mode = CNO_HTTP2;
-    if (c->client && CNO_FIRE(c, on_writev, &CNO_PREFACE, 1))
+    if (c->client && cno_writev(c, &CNO_PREFACE, 1))
         return CNO_ERROR_UP();
     if (cno_frame_write_settings(c, &CNO_SETTINGS_STANDARD, &c->settings[CNO_LOCAL]))
         return CNO_ERROR_UP();
@@ -791,6 +1362,31 @@ static int cno_when_h2_settings(struct cno_connection_t *c) {
     return CNO_STATE_H2_FRAME;
 }
 
+// Pass what `cno_when_h2_data` has collected (see `coalesce_data`) to the application
+// as one chunk. Only copies if there is more than one piece.
+static int cno_flush_data(struct cno_connection_t *c) {
+    const struct cno_buffer_t *iov = (const struct cno_buffer_t *) c->coalesced.data;
+    size_t n = c->coalesced.size / sizeof(struct cno_buffer_t);
+    if (!n)
+        return CNO_OK;
+    c->coalesced.size = 0;
+    struct cno_buffer_t merged = iov[0];
+    if (n > 1) {
+        c->coalesced_copy.size = 0;
+        for (size_t i = 0; i < n; i++)
+            if (cno_buffer_dyn_concat_with(c->allocator, &c->coalesced_copy, iov[i]))
+                return CNO_ERROR_UP();
+        merged = CNO_BUFFER_VIEW(c->coalesced_copy);
+    }
+    struct cno_stream_t *s = cno_stream_find(c, c->coalesced_stream);
+    if (s)
+        return cno_stream_fire_data(c, s, merged.data, merged.size);
+    // Reset in the meantime; same as in `cno_when_h2_data`.
+    return c->manual_connection_flow_control
+         ? cno_flow_credit(c, 0, &c->window_recv, &c->window_recv_pending, merged.size, c->window_recv_size)
+         : CNO_OK;
+}
+
 static int cno_when_h2_frame(struct cno_connection_t *c) {
     const uint8_t *base = (const uint8_t *) c->buffer.data;
     if (c->buffer.size < 9)
@@ -799,52 +1395,89 @@ static int cno_when_h2_frame(struct cno_connection_t *c) {
     struct cno_buffer_t payload = { c->buffer.data + 9, read4(base) >> 8 };
     if (payload.size > c->settings[CNO_LOCAL].max_frame_size)
         return cno_frame_write_error(c, CNO_RST_FRAME_SIZE_ERROR, "frame too big");
-    if (c->buffer.size < payload.size + 9)
-        return CNO_OK;
 
     struct cno_frame_t f = { base[3], base[4], read4(&base[5]) & 0x7FFFFFFFUL, payload };
-    if ((f.type == CNO_FRAME_HEADERS || f.type == CNO_FRAME_PUSH_PROMISE) && !(f.flags & CNO_FLAG_END_HEADERS)) {
-        size_t i = 0;
-        for (size_t offset = f.payload.size + 9;;) {
-            if (++i > CNO_MAX_CONTINUATIONS)
-                return cno_frame_write_error(c, CNO_RST_ENHANCE_YOUR_CALM, "too many CONTINUATIONs");
-            if (c->buffer.size < offset + 9)
-                return CNO_OK;
-
-            size_t size = read4(&base[offset]) >> 8;
-            if (size > c->settings[CNO_LOCAL].max_frame_size)
-                return cno_frame_write_error(c, CNO_RST_FRAME_SIZE_ERROR, "frame too big");
-            if (base[offset + 3] != CNO_FRAME_CONTINUATION)
-                return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "expected CONTINUATION");
-            if (base[offset + 4] & ~CNO_FLAG_END_HEADERS)
-                return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "invalid CONTINUATION flags");
-            if ((read4(&base[offset + 5]) & 0x7FFFFFFFUL) != f.stream)
-                return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "invalid CONTINUATION stream");
-
-            if (c->buffer.size < offset + 9 + size)
-                return CNO_OK;
-            if (base[offset + 4])
-                break;
-            offset += size + 9;
-        }
-        f.flags |= CNO_FLAG_END_HEADERS;
+    if (c->continued.stream && f.type != CNO_FRAME_CONTINUATION)
+        return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "expected CONTINUATION");
+    if (c->continued.stream && f.stream != c->continued.stream)
+        return cno_frame_write_error(c, CNO_RST_PROTOCOL_ERROR, "invalid CONTINUATION stream");
+    if ((f.type != CNO_FRAME_DATA || f.stream != c->coalesced_stream) && cno_flush_data(c))
+        return CNO_ERROR_UP();
 
-        size_t offset = f.payload.size + 9;
-        for (size_t size; i--; f.payload.size += size, offset += size + 9)
-            memmove((char *) f.payload.data + f.payload.size, base + offset + 9, size = read4(&base[offset]) >> 8);
-        memmove((char *) f.payload.data + f.payload.size, base + offset, c->buffer.size - offset);
-        c->buffer.size -= (offset - f.payload.size - 9);
+    if (f.type == CNO_FRAME_DATA) {
+        // Unless `on_frame` wants to see the whole payload (which can be up to 16 MiB),
+        // only wait for the padding length.
+        size_t head = 9 + (f.flags & CNO_FLAG_PADDED && f.payload.size);
+        if (c->buffer.size < (c->cb_code && c->cb_code->on_frame ? f.payload.size + 9 : head))
+            return CNO_OK;
+        if (CNO_FIRE(c, on_frame, &f) || cno_frame_handle_data(c, cno_stream_find(c, f.stream), &f))
+            return CNO_ERROR_UP();
+        cno_buffer_dyn_shift(&c->buffer, head);
+        return CNO_STATE_H2_DATA;
     }
 
+    if (c->buffer.size < payload.size + 9)
+        return CNO_OK;
+
     cno_buffer_dyn_shift(&c->buffer, f.payload.size + 9);
     if (CNO_FIRE(c, on_frame, &f))
         return CNO_ERROR_UP();
     // >Implementations MUST ignore and discard any frame that has a type that is unknown.
     if (f.type < CNO_FRAME_UNKNOWN && CNO_FRAME_HANDLERS[f.type](c, cno_stream_find(c, f.stream), &f))
         return CNO_ERROR_UP();
+    if (f.type == CNO_FRAME_PRIORITY_UPDATE && cno_frame_handle_priority_update(c, &f))
+        return CNO_ERROR_UP();
     return CNO_STATE_H2_FRAME;
 }
 
+// The payload of a DATA frame, minus the padding length, which `cno_frame_handle_data` has seen.
+static int cno_when_h2_data(struct cno_connection_t *c) {
+    size_t n = c->buffer.size, data = c->data_left;
+    if (n > (size_t) c->data_left + c->data_padding)
+        n = (size_t) c->data_left + c->data_padding;
+    if (!n && (c->data_left || c->data_padding))
+        return CNO_OK;
+    if (data > n)
+        data = n;
+    const char *piece = c->buffer.data;
+    cno_buffer_dyn_shift(&c->buffer, n);
+    c->data_left -= data;
+    c->data_padding -= n - data;
+
+    struct cno_stream_t *s = c->data_stream ? cno_stream_find(c, c->data_stream) : NULL;
+    if (c->data_stream && !s) {
+        // A callback has reset the stream, so the rest of the frame will never be seen.
+        c->data_stream = 0;
+        if (c->manual_connection_flow_control
+         && cno_flow_credit(c, 0, &c->window_recv, &c->window_recv_pending, data + c->data_left, c->window_recv_size))
+            return CNO_ERROR_UP();
+    }
+    if (s && data) {
+        if (!c->coalesce_data) {
+            if (cno_stream_fire_data(c, s, piece, data))
+                return CNO_ERROR_UP();
+        } else {
+            if (c->coalesced_stream != s->id && cno_flush_data(c))
+                return CNO_ERROR_UP();
+            struct cno_buffer_t chunk = { piece, data };
+            c->coalesced_stream = s->id;
+            if (cno_buffer_dyn_concat_with(c->allocator, &c->coalesced, (struct cno_buffer_t) { (const char *) &chunk, sizeof(chunk) }))
+                return CNO_ERROR_UP();
+        }
+    }
+    if (c->data_left || c->data_padding)
+        return CNO_OK;
+
+    if (c->data_flags & CNO_FLAG_END_STREAM && cno_flush_data(c))
+        return CNO_ERROR_UP();
+    if (!c->data_stream || !(s = cno_stream_find(c, c->data_stream)))
+        return CNO_STATE_H2_FRAME;
+    // No more DATA will arrive on this stream, so its window doesn't matter anymore.
+    if (c->data_flags & CNO_FLAG_END_STREAM)
+        return cno_frame_handle_end_stream(c, s, NULL) ? CNO_ERROR_UP() : CNO_STATE_H2_FRAME;
+    return cno_stream_flow_credit(c, s, c->data_credit) ? CNO_ERROR_UP() : CNO_STATE_H2_FRAME;
+}
+
 static int cno_when_h1_head(struct cno_connection_t *c) {
     if (!c->buffer.size)
         return CNO_OK;
@@ -866,9 +1499,17 @@ static int cno_when_h1_head(struct cno_connection_t *c) {
             return CNO_ERROR(WOULD_BLOCK, "already handling an HTTP/1.x message");
     }
 
-    struct cno_header_t headers[CNO_MAX_HEADERS + 2]; // + :scheme and :authority
+    // HTTP 1 has no use for the arena, so it holds picohttpparser's output and lowercased
+    // header names instead. (The input may be the caller's memory; see `cno_consume`.)
+    const size_t limit = (CNO_MAX_CONTINUATIONS + 1) * c->settings[CNO_LOCAL].max_frame_size;
+    if (cno_buffer_dyn_reserve_with(c->allocator, &c->headers, sizeof(struct cno_header_t) * (CNO_MAX_HEADERS + 2)) // + :scheme and :authority
+     || cno_buffer_dyn_reserve_with(c->allocator, &c->decoded, sizeof(struct phr_header) * CNO_MAX_HEADERS
+                                          + (c->buffer.size < limit ? c->buffer.size : limit)))
+        return CNO_ERROR_UP();
+    struct cno_header_t *headers = (struct cno_header_t *) c->headers.data;
+    struct phr_header *headers_phr = (struct phr_header *) c->decoded.data;
+    char *names = c->decoded.data + sizeof(struct phr_header) * CNO_MAX_HEADERS;
     struct cno_message_t m = { 0, {}, {}, headers, CNO_MAX_HEADERS };
-    struct phr_header headers_phr[CNO_MAX_HEADERS];
 
     int minor = 0;
     int ok = c->client
@@ -879,11 +1520,11 @@ static int cno_when_h1_head(struct cno_connection_t *c) {
             &m.method.data, &m.method.size, &m.path.data, &m.path.size, &minor,
             headers_phr, &m.headers_len, 1);
 
-    if (ok == -2) {
-        if (c->buffer.size > (CNO_MAX_CONTINUATIONS + 1) * c->settings[CNO_LOCAL].max_frame_size)
-            return CNO_ERROR(PROTOCOL, "HTTP/1.x message too big");
+    if (ok == -2 ? c->buffer.size > limit : ok > 0 && (size_t) ok > limit)
+        return CNO_ERROR(PROTOCOL, "HTTP/1.x message too big");
+
+    if (ok == -2)
         return CNO_OK;
-    }
 
     if (ok == -1)
         return CNO_ERROR(PROTOCOL, "bad HTTP/1.x message");
@@ -905,9 +1546,11 @@ static int cno_when_h1_head(struct cno_connection_t *c) {
             .value = { headers_phr[i].value, headers_phr[i].value_len },
         };
 
-        for (uint8_t *p = (uint8_t *) it->name.data, *e = p + it->name.size; p != e; p++)
-            if (!(*p = CNO_HEADER_TRANSFORM[*p]))
+        for (size_t k = 0; k < it->name.size; k++)
+            if (!(names[k] = CNO_HEADER_TRANSFORM[(uint8_t) it->name.data[k]]))
                 return CNO_ERROR(PROTOCOL, "invalid character in h1 header");
+        it->name.data = names;
+        names += it->name.size;
 
         if (!c->client && cno_buffer_eq(it->name, CNO_BUFFER_STRING("host"))) {
             headers[1].value = it->value;
@@ -990,7 +1633,7 @@ static int cno_when_h1_body(struct cno_connection_t *c) {
         c->remaining_h1_payload -= b.size;
         cno_buffer_dyn_shift(&c->buffer, b.size);
         struct cno_stream_t *s = cno_stream_find(c, c->last_stream[c->client]);
-        if (s && CNO_FIRE(c, on_message_data, s->id, b.data, b.size))
+        if (s && cno_stream_fire_data(c, s, b.data, b.size))
             return CNO_ERROR_UP();
     }
     return c->state == CNO_STATE_H1_BODY ? CNO_STATE_H1_TAIL : CNO_STATE_H1_CHUNK_TAIL;
@@ -1058,6 +1701,7 @@ static cno_state_handler_t * const CNO_STATE_MACHINE[] = {
     &cno_when_h2_preface,
     &cno_when_h2_settings,
     &cno_when_h2_frame,
+    &cno_when_h2_data,
     &cno_when_h1_head,
     &cno_when_h1_body,
     &cno_when_h1_tail,
@@ -1071,16 +1715,54 @@ int cno_begin(struct cno_connection_t *c, enum CNO_HTTP_VERSION version) {
     if (c->state != CNO_STATE_CLOSED)
         return CNO_ERROR(ASSERTION, "called connection_made twice");
     c->state = (version == CNO_HTTP2 ? CNO_STATE_H2_INIT : CNO_STATE_H1_HEAD);
+    c->encoder.allocator = c->decoder.allocator = c->stream_pool_own.allocator = c->allocator;
     return cno_consume(c, NULL, 0);
 }
 
-int cno_consume(struct cno_connection_t *c, const char *data, size_t size) {
-    if (cno_buffer_dyn_concat(&c->buffer, (struct cno_buffer_t) { data, size }))
-        return CNO_ERROR_UP();
+static int cno_consume_buffer(struct cno_connection_t *c) {
     for (int r; (r = CNO_STATE_MACHINE[c->state](c)) != 0; c->state = r)
         if (r < 0)
+            return c->coalesced.size = 0, CNO_ERROR_UP();
+    // Collected DATA points into the buffer, which may change after this.
+    return cno_flush_data(c);
+}
+
+static int cno_consume_input(struct cno_connection_t *c, const char *data, size_t size) {
+    // If something incomplete is buffered, append at most a frame's worth at a time until it's
+    // handled; whatever remains of the appended part is a suffix of the input.
+    while (c->buffer.size) {
+        size_t n = c->settings[CNO_LOCAL].max_frame_size + 9;
+        if (n > size)
+            n = size;
+        if (cno_buffer_dyn_concat_with(c->allocator, &c->buffer, (struct cno_buffer_t) { data, n }) || cno_consume_buffer(c))
             return CNO_ERROR_UP();
-    return CNO_OK;
+        data += n;
+        size -= n;
+        if (c->buffer.size <= n) {
+            data -= c->buffer.size;
+            size += c->buffer.size;
+            cno_buffer_dyn_shift(&c->buffer, c->buffer.size);
+        } else if (!size) {
+            return CNO_OK;
+        }
+    }
+
+    // Then parse the rest in place, copying only the incomplete tail. No state handler may
+    // write to `c->buffer` or keep pointers into it.
+    struct cno_buffer_dyn_t owned = c->buffer;
+    c->buffer = (struct cno_buffer_dyn_t) { (char *) data, size, 0, size };
+    int ret = cno_consume_buffer(c);
+    struct cno_buffer_t rest = CNO_BUFFER_VIEW(c->buffer);
+    c->buffer = owned;
+    return ret || cno_buffer_dyn_concat_with(c->allocator, &c->buffer, rest) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+int cno_consume(struct cno_connection_t *c, const char *data, size_t size) {
+    // Everything written in response, including from callbacks, goes out in one `on_writev`.
+    // Flush even on error: the last thing queued may be a GOAWAY explaining it.
+    cno_cork(c);
+    int ret = cno_consume_input(c, data, size);
+    return cno_uncork(c) || ret ? CNO_ERROR_UP() : CNO_OK;
 }
 
 int cno_shutdown(struct cno_connection_t *c) {
@@ -1095,10 +1777,14 @@ int cno_eof(struct cno_connection_t *c) {
 
     // h2 won't work over half-closed connections due to pings and flow control.
     c->state = CNO_STATE_CLOSED;
-    for (size_t i = 0; i < CNO_STREAM_BUCKETS; i++)
-        while (c->streams[i])
-            if (cno_stream_end(c, c->streams[i]))
-                return CNO_ERROR_UP();
+    // Ending a stream may shrink the table, so restart the scan every time.
+    while (c->stream_count[0] + c->stream_count[1]) {
+        size_t i = 0;
+        while (!c->streams[i])
+            i++;
+        if (cno_stream_end(c, c->streams[i]))
+            return CNO_ERROR_UP();
+    }
     return CNO_OK;
 }
 
@@ -1116,6 +1802,10 @@ int cno_write_reset(struct cno_connection_t *c, uint32_t sid, enum CNO_RST_STREA
     return s ? cno_frame_write_rst_stream(c, s, code) : CNO_OK; // assume idle streams have already been reset
 }
 
+int cno_stream_write_reset(struct cno_connection_t *c, struct cno_stream_t *s, enum CNO_RST_STREAM_CODE code) {
+    return c->mode == CNO_HTTP2 ? cno_frame_write_rst_stream(c, s, code) : CNO_OK;
+}
+
 int cno_write_push(struct cno_connection_t *c, uint32_t sid, const struct cno_message_t *m) {
     if (c->state == CNO_STATE_CLOSED)
         return CNO_ERROR(DISCONNECT, "connection closed");
@@ -1137,7 +1827,7 @@ int cno_write_push(struct cno_connection_t *c, uint32_t sid, const struct cno_me
         { CNO_BUFFER_STRING(":method"), m->method, 0 },
         { CNO_BUFFER_STRING(":path"),   m->path,   0 },
     };
-    if (cno_buffer_dyn_concat(&enc, PACK(I32(child)))
+    if (cno_buffer_dyn_concat_with(c->allocator, &enc, PACK(I32(child)))
      || cno_hpack_encode(&c->encoder, &enc, head, 2)
      || cno_hpack_encode(&c->encoder, &enc, m->headers, m->headers_len)
      || cno_frame_write(c, &(struct cno_frame_t){ CNO_FRAME_PUSH_PROMISE, CNO_FLAG_END_HEADERS, sid, CNO_BUFFER_VIEW(enc) }))
@@ -1145,16 +1835,18 @@ int cno_write_push(struct cno_connection_t *c, uint32_t sid, const struct cno_me
         // FIXME should make next `cno_consume` fail. The possible errors are NO_MEMORY
         //       or something from on_writev, so rolling back is pointless as keeping the old state
         //       will consume even more memory and on_writev should only fail on disconnect.
-        return cno_buffer_dyn_clear(&enc), CNO_ERROR_UP();
-    cno_buffer_dyn_clear(&enc);
+        return cno_buffer_dyn_clear_with(c->allocator, &enc), CNO_ERROR_UP();
+    cno_buffer_dyn_clear_with(c->allocator, &enc);
     return CNO_FIRE(c, on_message_head, child, m) || CNO_FIRE(c, on_message_tail, child, NULL);
 }
 
 static int cno_discard_remaining_payload(struct cno_connection_t *c, struct cno_stream_t *s) {
+    cno_sched_remove(c, s);
     s->w_state = CNO_STREAM_CLOSED;
     if (s->r_state == CNO_STREAM_CLOSED)
         return cno_stream_end_by_local(c, s);
-    if (!c->client && c->mode == CNO_HTTP2 && cno_frame_write_rst_stream(c, s, CNO_RST_NO_ERROR))
+    // No need to ask the client to stop sending if it already has.
+    if (!c->client && c->mode == CNO_HTTP2 && !s->end_received && cno_frame_write_rst_stream(c, s, CNO_RST_NO_ERROR))
         return CNO_ERROR_UP();
     return CNO_OK;
 }
@@ -1174,7 +1866,72 @@ static struct cno_buffer_t cno_fmt_chunk_length(char *b, size_t s, size_t n) {
     return (struct cno_buffer_t){ q, b + s - q };
 }
 
-static int cno_h1_write_head(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m, int final) {
+// Adapt a header to HTTP/1.x. Returns 0 if it should not be sent at all.
+static int cno_h1_header(struct cno_header_t *h, uint8_t *chunked) {
+    if (cno_buffer_eq(h->name, CNO_BUFFER_STRING(":authority"))) {
+        h->name = CNO_BUFFER_STRING("host");
+    } else if (cno_buffer_startswith(h->name, CNO_BUFFER_STRING(":"))) {
+        return 0; // :scheme, probably
+    } else if (cno_buffer_eq(h->name, CNO_BUFFER_STRING("content-length"))
+            || cno_buffer_eq(h->name, CNO_BUFFER_STRING("upgrade"))) {
+        // XXX not writing chunked on `upgrade` is a hack so that `GET` with final = 0 still works.
+        *chunked = 0;
+    } else if (cno_buffer_eq(h->name, CNO_BUFFER_STRING("transfer-encoding"))) {
+        // Either CNO_STREAM_H1_WRITING_CHUNKED is set, there's no body at all, or message
+        // is invalid because it contains both content-length and transfer-encoding.
+        return cno_remove_chunked_te(&h->value) != 0;
+    }
+    return 1;
+}
+
+// `n` is the number of prepared headers the array has space for.
+static void cno_header_set_free(struct cno_header_set_t *set, size_t n) {
+    for (size_t i = 0; i < set->headers_len; i++)
+        cno_hpack_prepared_clear(set->allocator, &set->headers[i]);
+    cno_free(set->allocator, set->headers, sizeof(struct cno_hpack_prepared_t) * n);
+    cno_buffer_dyn_clear_with(set->allocator, &set->h1);
+    *set = (struct cno_header_set_t) {};
+}
+
+int cno_header_set_init(struct cno_header_set_t *set, const struct cno_allocator_t *a,
+                        const struct cno_header_t *headers, size_t n)
+{
+    *set = (struct cno_header_set_t) { .allocator = a, .h1_chunked = 1 };
+    for (const struct cno_header_t *h = headers, *he = h + n; h != he; h++) {
+        if (cno_buffer_startswith(h->name, CNO_BUFFER_STRING(":")))
+            return CNO_ERROR(ASSERTION, "header sets cannot contain pseudo-headers");
+        for (const char *p = h->name.data, *e = p + h->name.size; p != e; p++)
+            if (isupper(*p))
+                return CNO_ERROR(ASSERTION, "header names should be lowercase");
+    }
+
+    if (n && !(set->headers = cno_alloc(a, sizeof(struct cno_hpack_prepared_t) * n)))
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_hpack_prepared_t) * n);
+
+    for (; set->headers_len < n; set->headers_len++) {
+        struct cno_header_t h = headers[set->headers_len];
+        if (cno_hpack_prepare(a, &set->headers[set->headers_len], &h))
+            return cno_header_set_free(set, n), CNO_ERROR_UP();
+        if (cno_h1_header(&h, &set->h1_chunked)
+         && (cno_buffer_dyn_concat_with(a, &set->h1, h.name)
+          || cno_buffer_dyn_concat_with(a, &set->h1, CNO_BUFFER_STRING(": "))
+          || cno_buffer_dyn_concat_with(a, &set->h1, h.value)
+          || cno_buffer_dyn_concat_with(a, &set->h1, CNO_BUFFER_STRING("\r\n"))))
+        {
+            set->headers_len++;
+            return cno_header_set_free(set, n), CNO_ERROR_UP();
+        }
+    }
+    return CNO_OK;
+}
+
+void cno_header_set_clear(struct cno_header_set_t *set) {
+    cno_header_set_free(set, set->headers_len);
+}
+
+static int cno_h1_write_head(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m,
+                             const struct cno_header_set_t *set, int final)
+{
     if (c->client
       ? CNO_WRITEV(c, m->method, CNO_BUFFER_STRING(" "), m->path, CNO_BUFFER_STRING(" HTTP/1.1\r\n"))
       // XXX technically, the reason string is meaningless so we don't need to specify the correct one.
@@ -1183,27 +1940,20 @@ static int cno_h1_write_head(struct cno_connection_t *c, struct cno_stream_t *s,
                       m->method.size ? m->method : CNO_BUFFER_STRING("No Reason"), CNO_BUFFER_STRING("\r\n")))
         return CNO_ERROR_UP();
 
-    s->writing_chunked = !cno_is_informational(m->code) && !final;
+    uint8_t chunked = !cno_is_informational(m->code) && !final;
     for (const struct cno_header_t *it = m->headers, *end = it + m->headers_len; it != end; ++it) {
         struct cno_header_t h = *it;
-        if (cno_buffer_eq(h.name, CNO_BUFFER_STRING(":authority"))) {
-            h.name = CNO_BUFFER_STRING("host");
-        } else if (cno_buffer_startswith(h.name, CNO_BUFFER_STRING(":"))) {
-            continue; // :scheme, probably
-        } else if (cno_buffer_eq(h.name, CNO_BUFFER_STRING("content-length"))
-                || cno_buffer_eq(h.name, CNO_BUFFER_STRING("upgrade"))) {
-            // XXX not writing chunked on `upgrade` is a hack so that `GET` with final = 0 still works.
-            s->writing_chunked = 0;
-        } else if (cno_buffer_eq(h.name, CNO_BUFFER_STRING("transfer-encoding"))) {
-            // Either CNO_STREAM_H1_WRITING_CHUNKED is set, there's no body at all, or message
-            // is invalid because it contains both content-length and transfer-encoding.
-            if (!cno_remove_chunked_te(&h.value))
-                continue;
-        }
-        // XXX maybe send as one call? Or at least pack ~32 buffers (~8 headers) or something.
+        if (!cno_h1_header(&h, &chunked))
+            continue;
         if (CNO_WRITEV(c, h.name, CNO_BUFFER_STRING(": "), h.value, CNO_BUFFER_STRING("\r\n")))
             return CNO_ERROR_UP();
     }
+    if (set) {
+        chunked &= set->h1_chunked;
+        if (set->h1.size && CNO_WRITEV(c, CNO_BUFFER_VIEW(set->h1)))
+            return CNO_ERROR_UP();
+    }
+    s->writing_chunked = chunked;
     if (CNO_WRITEV(c, s->writing_chunked ? CNO_BUFFER_STRING("transfer-encoding: chunked\r\n\r\n") : CNO_BUFFER_STRING("\r\n")))
         return CNO_ERROR_UP();
 
@@ -1216,7 +1966,9 @@ static int cno_h1_write_head(struct cno_connection_t *c, struct cno_stream_t *s,
     return CNO_OK;
 }
 
-static int cno_h2_write_head(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m, int final) {
+static int cno_h2_write_head(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m,
+                             const struct cno_header_set_t *set, int final)
+{
     if (m->code == 101)
         return CNO_ERROR(ASSERTION, "cannot switch protocols over an http2 connection");
     int flags = (final ? CNO_FLAG_END_STREAM : 0) | CNO_FLAG_END_HEADERS;
@@ -1228,13 +1980,14 @@ static int cno_h2_write_head(struct cno_connection_t *c, struct cno_stream_t *s,
     };
     if (cno_hpack_encode(&c->encoder, &enc, c->client ? head + 1 : head, c->client ? 2 : 1)
      || cno_hpack_encode(&c->encoder, &enc, m->headers, m->headers_len)
+     || (set && cno_hpack_encode_prepared(&c->encoder, &enc, set->headers, set->headers_len))
      || cno_frame_write(c, &(struct cno_frame_t){ CNO_FRAME_HEADERS, flags, s->id, CNO_BUFFER_VIEW(enc) }))
         // Irrecoverable (compression state desync). FIXME: see `cno_write_push`.
-        return cno_buffer_dyn_clear(&enc), CNO_ERROR_UP();
-    return cno_buffer_dyn_clear(&enc), CNO_OK;
+        return cno_buffer_dyn_clear_with(c->allocator, &enc), CNO_ERROR_UP();
+    return cno_buffer_dyn_clear_with(c->allocator, &enc), CNO_OK;
 }
 
-int cno_write_head(struct cno_connection_t *c, uint32_t sid, const struct cno_message_t *m, int final) {
+static int cno_check_message(struct cno_connection_t *c, const struct cno_message_t *m, int final) {
     if (c->state == CNO_STATE_CLOSED)
         return CNO_ERROR(DISCONNECT, "connection closed");
 
@@ -1246,19 +1999,47 @@ int cno_write_head(struct cno_connection_t *c, uint32_t sid, const struct cno_me
         for (const char *p = h->name.data, *e = p + h->name.size; p != e; p++)
             if (isupper(*p))
                 return CNO_ERROR(ASSERTION, "header names should be lowercase");
+    return CNO_OK;
+}
 
-    struct cno_stream_t *s = cno_stream_find(c, sid);
-    if (c->client && !s && !(s = cno_stream_new(c, sid, CNO_LOCAL)))
-        return CNO_ERROR_UP();
-    if (!s || s->w_state != CNO_STREAM_HEADERS)
+static int cno_write_head_checked(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m,
+                                  const struct cno_header_set_t *set, int final)
+{
+    if (s->w_state != CNO_STREAM_HEADERS)
         return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
 
     s->reading_head_response = cno_buffer_eq(m->method, CNO_BUFFER_STRING("HEAD"));
-    if ((c->mode == CNO_HTTP2 ? cno_h2_write_head : cno_h1_write_head)(c, s, m, final))
-        return CNO_ERROR_UP();
+    cno_cork(c);
+    if ((c->mode == CNO_HTTP2 ? cno_h2_write_head : cno_h1_write_head)(c, s, m, set, final))
+        return cno_uncork(c), CNO_ERROR_UP();
     if (m->code == 101 || !cno_is_informational(m->code))
         s->w_state = CNO_STREAM_DATA;
-    return final && cno_discard_remaining_payload(c, s) ? CNO_ERROR_UP() : CNO_OK;
+    if (final && cno_discard_remaining_payload(c, s))
+        return cno_uncork(c), CNO_ERROR_UP();
+    return cno_uncork(c);
+}
+
+int cno_write_head_set(struct cno_connection_t *c, uint32_t sid, const struct cno_message_t *m,
+                       const struct cno_header_set_t *set, int final)
+{
+    if (cno_check_message(c, m, final))
+        return CNO_ERROR_UP();
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    if (c->client && !s && !(s = cno_stream_new(c, sid, CNO_LOCAL)))
+        return CNO_ERROR_UP();
+    if (!s)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    return cno_write_head_checked(c, s, m, set, final);
+}
+
+int cno_stream_write_head(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_message_t *m,
+                          const struct cno_header_set_t *set, int final)
+{
+    return cno_check_message(c, m, final) ? CNO_ERROR_UP() : cno_write_head_checked(c, s, m, set, final);
+}
+
+int cno_write_head(struct cno_connection_t *c, uint32_t sid, const struct cno_message_t *m, int final) {
+    return cno_write_head_set(c, sid, m, NULL, final);
 }
 
 static int cno_h1_write_data(struct cno_connection_t *c, struct cno_stream_t *s, struct cno_buffer_t *b, int final) {
@@ -1270,13 +2051,17 @@ static int cno_h1_write_data(struct cno_connection_t *c, struct cno_stream_t *s,
     return CNO_WRITEV(c, cno_fmt_chunk_length((char[24]){}, 24, b->size), *b, tail);
 }
 
-static int cno_h2_write_data(struct cno_connection_t *c, struct cno_stream_t *s, struct cno_buffer_t *b, int final) {
+// How much DATA the flow control windows allow to send on a stream.
+static uint64_t cno_h2_send_limit(const struct cno_connection_t *c, const struct cno_stream_t *s) {
     int64_t limit = s->window_send + c->settings[CNO_REMOTE].initial_window_size;
     if (limit > c->window_send)
         limit = c->window_send;
-    if (limit < 0)
-        limit = 0;
-    if (b->size > (uint64_t) limit) {
+    return limit < 0 ? 0 : (uint64_t) limit;
+}
+
+static int cno_h2_write_data(struct cno_connection_t *c, struct cno_stream_t *s, struct cno_buffer_t *b, int final) {
+    uint64_t limit = cno_h2_send_limit(c, s);
+    if (b->size > limit) {
         b->size = limit;
         final = 0;
     }
@@ -1285,6 +2070,8 @@ static int cno_h2_write_data(struct cno_connection_t *c, struct cno_stream_t *s,
         return CNO_ERROR_UP();
     c->window_send -= b->size;
     s->window_send -= b->size;
+    if (b->size)
+        cno_sched_rotate(c, s);
     return CNO_OK;
 }
 
@@ -1293,13 +2080,180 @@ int cno_write_data(struct cno_connection_t *c, uint32_t sid, const char *data, s
         return CNO_ERROR(DISCONNECT, "connection closed");
 
     struct cno_stream_t *s = cno_stream_find(c, sid);
-    if (!s || s->w_state != CNO_STREAM_DATA)
+    if (!s)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    return cno_stream_write_data(c, s, data, size, final);
+}
+
+int cno_stream_write_data(struct cno_connection_t *c, struct cno_stream_t *s, const char *data, size_t size, int final) {
+    if (c->state == CNO_STATE_CLOSED)
+        return CNO_ERROR(DISCONNECT, "connection closed");
+    if (s->w_state != CNO_STREAM_DATA)
         return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    if (s->send_queue.size)
+        return CNO_ERROR(ASSERTION, "this stream has queued data");
 
     struct cno_buffer_t b = {data, size};
-    if ((c->mode == CNO_HTTP2 ? cno_h2_write_data : cno_h1_write_data)(c, s, &b, final))
-        return CNO_ERROR_UP();
-    return final && cno_discard_remaining_payload(c, s) ? CNO_ERROR_UP() : (int)b.size;
+    cno_cork(c);
+    // If flow control did not allow to send everything, END_STREAM has not been sent either.
+    if ((c->mode == CNO_HTTP2 ? cno_h2_write_data : cno_h1_write_data)(c, s, &b, final)
+     || (final && b.size == size && cno_discard_remaining_payload(c, s)))
+        return cno_uncork(c), CNO_ERROR_UP();
+    return cno_uncork(c) ? CNO_ERROR_UP() : (int)b.size;
+}
+
+static int cno_h1_write_file(struct cno_connection_t *c, struct cno_stream_t *s, int fd, uint64_t offset,
+                             size_t *size, int final)
+{
+    if (!s->writing_chunked)
+        return cno_writefile(c, fd, offset, *size);
+    if (!*size)
+        return final ? CNO_WRITEV(c, CNO_BUFFER_STRING("0\r\n\r\n")) : CNO_OK;
+    struct cno_buffer_t tail = final ? CNO_BUFFER_STRING("\r\n0\r\n\r\n") : CNO_BUFFER_STRING("\r\n");
+    return CNO_WRITEV(c, cno_fmt_chunk_length((char[24]){}, 24, *size))
+        || cno_writefile(c, fd, offset, *size)
+        || CNO_WRITEV(c, tail) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+// Same as `cno_h2_write_data` + `cno_frame_write`, except only frame headers are buffers.
+static int cno_h2_write_file(struct cno_connection_t *c, struct cno_stream_t *s, int fd, uint64_t offset,
+                             size_t *size, int final)
+{
+    uint64_t limit = cno_h2_send_limit(c, s);
+    if (*size > limit) {
+        *size = limit;
+        final = 0;
+    }
+    if (!*size && !final)
+        return CNO_OK;
+    size_t left = *size, max = c->settings[CNO_REMOTE].max_frame_size;
+    do {
+        size_t n = left < max ? left : max;
+        uint8_t flags = final && n == left ? CNO_FLAG_END_STREAM : 0;
+        if (CNO_WRITEV(c, PACK(I24(n), I8(CNO_FRAME_DATA), I8(flags), I32(s->id))) || cno_writefile(c, fd, offset, n))
+            return CNO_ERROR_UP();
+        offset += n;
+        left -= n;
+    } while (left);
+    c->window_send -= *size;
+    s->window_send -= *size;
+    if (*size)
+        cno_sched_rotate(c, s);
+    return CNO_OK;
+}
+
+int cno_stream_write_file(struct cno_connection_t *c, struct cno_stream_t *s, int fd, uint64_t offset, size_t size,
+                          int final)
+{
+    if (c->state == CNO_STATE_CLOSED)
+        return CNO_ERROR(DISCONNECT, "connection closed");
+    if (!c->cb_code || !c->cb_code->on_writefile)
+        return CNO_ERROR(ASSERTION, "on_writefile is not set");
+    if (s->w_state != CNO_STREAM_DATA)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    if (s->send_queue.size)
+        return CNO_ERROR(ASSERTION, "this stream has queued data");
+    if (size > INT_MAX) {
+        // Otherwise the return value would overflow.
+        size = INT_MAX;
+        final = 0;
+    }
+
+    size_t sent = size;
+    cno_cork(c);
+    if ((c->mode == CNO_HTTP2 ? cno_h2_write_file : cno_h1_write_file)(c, s, fd, offset, &sent, final)
+     || (final && sent == size && cno_discard_remaining_payload(c, s)))
+        return cno_uncork(c), CNO_ERROR_UP();
+    return cno_uncork(c) ? CNO_ERROR_UP() : (int)sent;
+}
+
+int cno_write_file(struct cno_connection_t *c, uint32_t sid, int fd, uint64_t offset, size_t size, int final) {
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    if (!s)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    return cno_stream_write_file(c, s, fd, offset, size, final);
+}
+
+static int cno_h1_write_datav(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_buffer_t *iov,
+                              size_t n, size_t *size, int final)
+{
+    if (!s->writing_chunked)
+        return cno_writev_ref(c, iov, n);
+    if (!*size)
+        return final ? CNO_WRITEV(c, CNO_BUFFER_STRING("0\r\n\r\n")) : CNO_OK;
+    struct cno_buffer_t tail = final ? CNO_BUFFER_STRING("\r\n0\r\n\r\n") : CNO_BUFFER_STRING("\r\n");
+    return CNO_WRITEV(c, cno_fmt_chunk_length((char[24]){}, 24, *size))
+        || cno_writev_ref(c, iov, n)
+        || CNO_WRITEV(c, tail) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+// Same as `cno_h2_write_data`, but each frame may span several buffers.
+static int cno_h2_write_datav(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_buffer_t *iov,
+                              size_t n __attribute__((unused)), size_t *size, int final)
+{
+    uint64_t limit = cno_h2_send_limit(c, s);
+    if (*size > limit) {
+        *size = limit;
+        final = 0;
+    }
+    if (!*size && !final)
+        return CNO_OK;
+    size_t left = *size, max = c->settings[CNO_REMOTE].max_frame_size, skip = 0;
+    do {
+        size_t length = left < max ? left : max;
+        uint8_t flags = final && length == left ? CNO_FLAG_END_STREAM : 0;
+        if (CNO_WRITEV(c, PACK(I24(length), I8(CNO_FRAME_DATA), I8(flags), I32(s->id))))
+            return CNO_ERROR_UP();
+        for (size_t rest = length; rest;) {
+            struct cno_buffer_t piece = cno_buffer_shift(*iov, skip);
+            if (piece.size > rest)
+                piece.size = rest;
+            if (cno_writev_ref(c, &piece, 1))
+                return CNO_ERROR_UP();
+            rest -= piece.size;
+            if ((skip += piece.size) == iov->size)
+                iov++, skip = 0;
+        }
+        left -= length;
+    } while (left);
+    c->window_send -= *size;
+    s->window_send -= *size;
+    if (*size)
+        cno_sched_rotate(c, s);
+    return CNO_OK;
+}
+
+int cno_stream_write_datav(struct cno_connection_t *c, struct cno_stream_t *s, const struct cno_buffer_t *iov,
+                           size_t n, int final)
+{
+    if (c->state == CNO_STATE_CLOSED)
+        return CNO_ERROR(DISCONNECT, "connection closed");
+    if (s->w_state != CNO_STREAM_DATA)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    if (s->send_queue.size)
+        return CNO_ERROR(ASSERTION, "this stream has queued data");
+
+    size_t size = 0;
+    for (size_t i = 0; i < n; i++)
+        size += iov[i].size;
+    if (size > INT_MAX)
+        return CNO_ERROR(ASSERTION, "too much data in one call");
+
+    size_t sent = size;
+    cno_cork(c);
+    // The buffers are referenced by the queue, so it must be flushed before returning
+    // (even on error) instead of waiting for the outermost `cno_uncork`.
+    if ((c->mode == CNO_HTTP2 ? cno_h2_write_datav : cno_h1_write_datav)(c, s, iov, n, &sent, final)
+     || (final && sent == size && cno_discard_remaining_payload(c, s)))
+        return cno_flush(c), cno_uncork(c), CNO_ERROR_UP();
+    return cno_flush(c) || cno_uncork(c) ? CNO_ERROR_UP() : (int)sent;
+}
+
+int cno_write_datav(struct cno_connection_t *c, uint32_t sid, const struct cno_buffer_t *iov, size_t n, int final) {
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    if (!s)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    return cno_stream_write_datav(c, s, iov, n, final);
 }
 
 int cno_write_ping(struct cno_connection_t *c, const char data[8]) {
@@ -1318,12 +2272,126 @@ int cno_write_frame(struct cno_connection_t *c, const struct cno_frame_t *f) {
 }
 
 int cno_open_flow(struct cno_connection_t *c, uint32_t sid, uint32_t delta) {
-    if (c->mode != CNO_HTTP2 || !sid || !delta)
-        return CNO_OK; // TODO don't ignore connection flow updates
+    if (c->mode != CNO_HTTP2 || !delta)
+        return CNO_OK;
+    if (!sid)
+        return c->manual_connection_flow_control
+             ? cno_flow_credit(c, 0, &c->window_recv, &c->window_recv_pending, delta, c->window_recv_size)
+             : cno_flow_grow(c, delta);
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    return s ? cno_stream_flow_credit(c, s, delta) : CNO_OK;
+}
+
+int cno_want_write(struct cno_connection_t *c, uint32_t sid, int want) {
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    if (!s || s->w_state == CNO_STREAM_CLOSED)
+        return want ? CNO_ERROR(INVALID_STREAM, "this stream is not writable") : CNO_OK;
+    if (!want && !s->send_queue.size)
+        cno_sched_remove(c, s);
+    else if (want && !s->sched_next)
+        cno_sched_insert(c, s);
+    return CNO_OK;
+}
+
+int cno_set_priority(struct cno_connection_t *c, uint32_t sid, uint8_t urgency, int incremental) {
     struct cno_stream_t *s = cno_stream_find(c, sid);
     if (!s)
-        return CNO_OK;
-    s->window_recv += delta;
-    struct cno_frame_t update = { CNO_FRAME_WINDOW_UPDATE, 0, sid, PACK(I32(delta)) };
-    return cno_frame_write(c, &update);
+        return CNO_ERROR(INVALID_STREAM, "no such stream");
+    if (urgency > 7)
+        return CNO_ERROR(ASSERTION, "urgency out of range (0..7)");
+    cno_sched_set_priority(c, s, urgency, !!incremental);
+    return CNO_OK;
+}
+
+// Streams with data in `send_queue` are written by the library, the rest by the application.
+static struct cno_stream_t *cno_sched_next(struct cno_connection_t *c, int queued, size_t *limit) {
+    int64_t window = c->mode == CNO_HTTP2 ? c->window_send : INT64_MAX;
+    if (window <= 0)
+        return NULL;
+    for (unsigned mask = c->sched_mask; mask; mask &= mask - 1) {
+        struct cno_stream_t *head = c->sched[__builtin_ctz(mask)], *s = head;
+        do {
+            int64_t w = c->mode == CNO_HTTP2 ? s->window_send + c->settings[CNO_REMOTE].initial_window_size : INT64_MAX;
+            if (w > window)
+                w = window;
+            if (w <= 0 || (s->send_queue.size != 0) != queued)
+                continue;
+            // One frame's worth, then others get a turn (see `cno_sched_rotate`).
+            if (s->incremental && c->mode == CNO_HTTP2 && w > c->settings[CNO_REMOTE].max_frame_size)
+                w = c->settings[CNO_REMOTE].max_frame_size;
+            *limit = (uint64_t) w < SIZE_MAX ? (size_t) w : SIZE_MAX;
+            return s;
+        } while ((s = s->sched_next) != head);
+    }
+    return NULL;
+}
+
+uint32_t cno_next_write(struct cno_connection_t *c, size_t *limit) {
+    struct cno_stream_t *s = cno_sched_next(c, 0, limit);
+    return s ? s->id : 0;
+}
+
+// Send up to `limit` bytes from the front of a stream's queue.
+static int cno_stream_send_queued(struct cno_connection_t *c, struct cno_stream_t *s, size_t limit) {
+    uint32_t sid = s->id;
+    while (s && s->send_queue.size) {
+        struct cno_queued_t *q = (struct cno_queued_t *) s->send_queue.data;
+        struct cno_buffer_t b = { q->data.data, q->data.size < limit ? q->data.size : limit };
+        int final = q->final && b.size == q->data.size;
+        if ((c->mode == CNO_HTTP2 ? cno_h2_write_data : cno_h1_write_data)(c, s, &b, final))
+            return CNO_ERROR_UP();
+        if (b.size < q->data.size) {
+            q->data = cno_buffer_shift(q->data, b.size);
+            return CNO_OK;
+        }
+        limit -= b.size;
+        void *token = q->token;
+        cno_buffer_dyn_shift(&s->send_queue, sizeof(struct cno_queued_t));
+        if (!s->send_queue.size)
+            cno_sched_remove(c, s);
+        if ((final && cno_discard_remaining_payload(c, s)) || CNO_FIRE(c, on_data_release, token))
+            return CNO_ERROR_UP();
+        // Either of these may have ended the stream.
+        s = cno_stream_find(c, sid);
+    }
+    return CNO_OK;
+}
+
+static int cno_send_queued(struct cno_connection_t *c) {
+    size_t limit;
+    for (struct cno_stream_t *s; (s = cno_sched_next(c, 1, &limit));)
+        if (cno_stream_send_queued(c, s, limit))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+int cno_stream_queue_data(struct cno_connection_t *c, struct cno_stream_t *s, const char *data, size_t size,
+                          int final, void *token)
+{
+    if (c->state == CNO_STATE_CLOSED)
+        return CNO_ERROR(DISCONNECT, "connection closed");
+    if (s->w_state != CNO_STREAM_DATA || (s->send_queue.size
+     && ((const struct cno_queued_t *) (s->send_queue.data + s->send_queue.size))[-1].final))
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+
+    struct cno_queued_t q = { { data, size }, token, !!final };
+    if (cno_buffer_dyn_concat_with(c->allocator, &s->send_queue, (struct cno_buffer_t) { (const char *) &q, sizeof(q) }))
+        return CNO_ERROR_UP();
+    if (!s->sched_next)
+        cno_sched_insert(c, s);
+    cno_cork(c);
+    // Every other stream with queued data is blocked already, so only this one may be sent.
+    int ret = cno_send_queued(c);
+    return cno_uncork(c) || ret ? CNO_ERROR_UP() : CNO_OK;
+}
+
+int cno_queue_data(struct cno_connection_t *c, uint32_t sid, const char *data, size_t size, int final, void *token) {
+    struct cno_stream_t *s = cno_stream_find(c, sid);
+    if (!s)
+        return CNO_ERROR(INVALID_STREAM, "this stream is not writable");
+    return cno_stream_queue_data(c, s, data, size, final, token);
+}
+
+int cno_stream_open_flow(struct cno_connection_t *c, struct cno_stream_t *s, uint32_t delta) {
+    return c->mode == CNO_HTTP2 && delta ? cno_stream_flow_credit(c, s, delta) : CNO_OK;
 }
@@ -35,6 +35,7 @@ enum CNO_FRAME_TYPE {
     CNO_FRAME_WINDOW_UPDATE = 0x8,
     CNO_FRAME_CONTINUATION  = 0x9,
     CNO_FRAME_UNKNOWN       = 0xa,
+    CNO_FRAME_PRIORITY_UPDATE = 0x10, // RFC 9218
 };
 
 enum CNO_RST_STREAM_CODE {
@@ -89,6 +90,29 @@ struct cno_message_t {
 
 struct cno_stream_t;
 
+// Freed stream objects, kept for reuse so that starting a stream needs no allocation.
+// Can be shared by connections that are only used from one thread.
+struct cno_stream_pool_t {
+    // Free objects beyond this many are returned to the heap.
+    size_t limit;
+    // Where new objects come from; NULL means the C library's `malloc`. For a connection's
+    // own pool, this is set to `cno_connection_t.allocator`.
+    const struct cno_allocator_t *allocator;
+// private:
+    size_t size;
+    struct cno_stream_t *free;
+};
+
+// A list of headers to send with many messages, validated and prepared for encoding
+// in advance. Pseudo-headers are not allowed. See `cno_write_head_set`.
+struct cno_header_set_t {
+    const struct cno_allocator_t *allocator;
+    struct cno_hpack_prepared_t *headers;
+    size_t headers_len;
+    struct cno_buffer_dyn_t h1; // already formatted as HTTP/1.x header lines
+    uint8_t h1_chunked; // 0 if one of the headers prevents chunked encoding, e.g. content-length
+};
+
 struct cno_settings_t {
     union {
         // TODO implement this in a way not dependent on alignment
@@ -105,9 +129,22 @@ struct cno_settings_t {
     };
 };
 
+// What a connection's memory is spent on, in bytes; see `cno_memory_usage`. Buffers count
+// at their capacity, not the amount of data in them.
+struct cno_memory_usage_t {
+    size_t connection;  // the `struct cno_connection_t` itself
+    size_t buffers;     // input, header block, output (while corked), DATA coalescing
+    size_t streams;     // open streams' objects and send queues; the stream table
+    size_t stream_pool; // the connection's own pool, not a shared one
+    size_t encoder;     // the HPACK dynamic tables
+    size_t decoder;
+    size_t total;
+};
+
 struct cno_vtable_t {
     // There is something to send to the other side. Transport level is outside
-    // the scope of this library.
+    // the scope of this library. Everything written during one `cno_consume` (and
+    // between `cno_cork` and `cno_uncork`) is normally passed in a single call.
     int (*on_writev)(void *, const struct cno_buffer_t *, size_t count);
     // A new stream has been created due to sending/receiving a request or sending
     // a push promise. In the latter two cases, `on_message_head` will be called
@@ -126,12 +163,14 @@ struct cno_vtable_t {
     // Client only: server is intending to push a response to a request that
     // it anticipates in advance.
     int (*on_message_push)(void *, uint32_t id, const struct cno_message_t *, uint32_t parent);
-    // A chunk of the payload has arrived.
+    // A chunk of the payload has arrived. In HTTP 2 mode, a DATA frame may be split into
+    // several chunks if it is not received all at once.
     int (*on_message_data)(void *, uint32_t id, const char *, size_t);
     // All chunks of the payload (and possibly trailers) have arrived.
     // Trailers (like headers, but come after the payload) have been received.
     int (*on_message_tail)(void *, uint32_t id, const struct cno_message_t * /* nullable */ trailers);
-    // An HTTP 2 frame has been received.
+    // An HTTP 2 frame has been received. (If this is set, DATA frames are buffered until
+    // fully received, as the payload is passed here.)
     int (*on_frame)(void *, const struct cno_frame_t *);
     // An HTTP 2 frame will be sent with `on_data` soon.
     int (*on_frame_send)(void *, const struct cno_frame_t *);
@@ -144,6 +183,17 @@ struct cno_vtable_t {
     // before the next call to `cno_consume`, all further data will be forwarded as
     // payload. Otherwise, the upgrade is ignored.
     int (*on_upgrade)(void *);
+    // If set, called instead of `on_message_data`/`on_stream_end` with the pointer attached
+    // to the stream (see `cno_stream_set_data`). The stream is already gone by the time
+    // `on_stream_close` is called, so only its id remains.
+    int (*on_stream_data)(void *, struct cno_stream_t *, void *stream_data, const char *, size_t);
+    int (*on_stream_close)(void *, uint32_t id, void *stream_data);
+    // A buffer passed to `cno_queue_data` is no longer needed.
+    int (*on_data_release)(void *, void *token);
+    // Same as `on_writev`, but the data is `size` bytes of a file starting at `offset`. Used
+    // by `cno_write_file`, e.g. to send the payload with `sendfile` or `splice` while
+    // the library only writes the frame (or chunk) headers.
+    int (*on_writefile)(void *, int fd, uint64_t offset, size_t size);
 };
 
 struct cno_connection_t {
@@ -151,9 +201,41 @@ struct cno_connection_t {
     const struct cno_vtable_t *cb_code;
     // Passed as the first argument to all callbacks.
     void *cb_data;
+    // Max. size of the dynamic table used to compress outbound headers. The peer may lower
+    // it further; takes effect when the peer's settings arrive. Defaults to 4096. (What gets
+    // inserted into the table can be controlled with `encoder.index_policy`.)
+    uint32_t encoder_table_size;
+    // WINDOW_UPDATEs are delayed until at least this percentage of a receive window has
+    // been consumed, then sent as one frame. 0 means after every DATA frame. Valid values
+    // are 0 to 100; anything above is treated as 100. Defaults to 50.
+    uint8_t window_update_percent;
+    // If nonzero, receive windows are grown towards the bandwidth-delay product (measured
+    // with PINGs that do not trigger `on_pong`), but the connection's only up to this many
+    // bytes and each stream's up to half of that. This is how much data the peer may send
+    // that has not been processed yet. SETTINGS_INITIAL_WINDOW_SIZE is not changed.
+    uint32_t window_autotune_limit;
+    // Where stream objects come from and go to; if NULL (the default), a pool owned by
+    // the connection that keeps up to CNO_STREAM_POOL_LIMIT of them. A shared pool must
+    // outlive the connection.
+    struct cno_stream_pool_t *stream_pool;
+    // Used for all memory the connection, its streams (unless from a shared pool), and its
+    // HPACK tables need. Must be set before `cno_begin` and outlive the connection. NULL
+    // (the default) means the C library's `malloc` & co. Header sets are not per-connection,
+    // so they are given one of their own; see `cno_header_set_init`.
+    const struct cno_allocator_t *allocator;
     // Disable automatic sending of stream WINDOW_UPDATEs after receiving DATA; application
     // must call `cno_open_flow` after processing a chunk from `on_message_data`.
     uint8_t manual_flow_control : 1;
+    // Same, but for the connection's window (`cno_open_flow` with stream 0).
+    uint8_t manual_connection_flow_control : 1;
+    // Within one `cno_consume`, pass the payloads of consecutive DATA frames on the same
+    // stream to `on_message_data` (or `on_stream_data`) as one chunk instead of one per frame.
+    // This requires copying them into a per-connection buffer unless there is only one.
+    uint8_t coalesce_data : 1;
+    // Call `cno_hibernate` (without compacting HPACK tables) whenever the connection goes idle,
+    // i.e. the outermost `cno_consume` or write leaves no open streams and no partial input.
+    // Saves memory while waiting for the next request at the cost of a few allocations each.
+    uint8_t hibernate_when_idle : 1;
     // Disable special handling of the "Upgrade: h2c" header in HTTP/1.x mode.
     // NOTE: this is set by default because:
     //   1. when using tls, you *have* to set this to be compliant;
@@ -171,6 +253,11 @@ struct cno_connection_t {
     uint8_t  state;
      int64_t window_recv;
      int64_t window_send;
+    uint32_t window_recv_pending;
+    uint32_t window_recv_size;         // what `window_recv` is refilled up to
+    uint32_t window_stream_grown;      // added to stream windows by auto-tuning; see `cno_bdp_update`
+    uint32_t bdp_bytes;                // received since the auto-tuning PING was sent
+    uint8_t  bdp_pinging;
     uint32_t last_stream[2]; // dereferencable with CNO_REMOTE/CNO_LOCAL
     uint32_t stream_count[2];
     uint32_t goaway_sent;
@@ -179,24 +266,76 @@ struct cno_connection_t {
     uint64_t remaining_h1_payload; // can't be monitored in cno_stream_t because the stream might get reset
     struct cno_settings_t settings[2];
     struct cno_buffer_dyn_t buffer;
+    // The header block being received. Nothing can come between a HEADERS/PUSH_PROMISE and
+    // its CONTINUATIONs, so there is at most one; see `cno_hpack_decode_fragment`.
+    struct cno_buffer_dyn_t decoded;   // strings of the headers
+    struct cno_buffer_dyn_t headers;   // `struct cno_header_t`s; also used by HTTP 1
+    struct cno_buffer_dyn_t fragment;  // a header split between frames
+    struct cno_frame_t continued;      // the HEADERS/PUSH_PROMISE, minus payload; stream = 0 if none
+    uint32_t continued_target;         // stream for the message, 0 if it should be ignored
+    size_t   continued_wire;           // bytes of HEADERS/CONTINUATION frames so far, incl. frame headers
+    size_t   continued_size;           // as defined for SETTINGS_MAX_HEADER_LIST_SIZE
+    // The DATA frame being received. Its payload is delivered as it arrives.
+    uint32_t data_stream;              // 0 if the payload should be ignored
+    uint32_t data_left;                // bytes of the payload not yet received, excluding padding
+    uint32_t data_padding;             // bytes of padding after that
+    uint32_t data_credit;              // to return to the stream's window once received
+    uint8_t  data_flags;
+    uint32_t coalesced_stream;         // see `coalesce_data`
+    struct cno_buffer_dyn_t coalesced; // `struct cno_buffer_t`s pointing into the input
+    struct cno_buffer_dyn_t coalesced_copy;
+    uint32_t corked;                   // nesting depth of `cno_cork`
+    struct cno_buffer_dyn_t cork_iov;  // `struct cno_buffer_t`s; see `cno_writev`
+    struct cno_buffer_dyn_t cork_data;
     struct cno_hpack_t decoder;
     struct cno_hpack_t encoder;
-    struct cno_stream_t *streams[CNO_STREAM_BUCKETS];
+    struct cno_stream_t **streams;     // open addressing, 2^stream_table_bits slots; NULL if none
+    struct cno_stream_t *stream_last;  // the most recently looked up
+    uint8_t  stream_table_bits;
+    uint8_t  sched_mask;               // bit N set if `sched[N]` is not empty
+    uint8_t  priority_rfc9218;         // whether to ignore RFC 7540 priority signals
+    struct cno_stream_t *sched[8];     // see `cno_sched_insert`
+    struct cno_stream_pool_t stream_pool_own;
 };
 
 // Initialize a freshly constructed connection object. (Set up the callbacks after this.)
 void cno_init(struct cno_connection_t *, enum CNO_CONNECTION_KIND);
 
-// Free all resources associated with a connection. *Does not emit events*: if you store
-// additional per-stream data, discard it.
+// Free all resources associated with a connection. *Does not emit events* other than
+// `on_data_release`: if you store additional per-stream data, discard it.
 void cno_fini(struct cno_connection_t *);
 
+// Initialize an empty stream pool. See `cno_connection_t.stream_pool`.
+void cno_stream_pool_init(struct cno_stream_pool_t *, size_t limit);
+
+// Return all free objects in a pool to the heap. (It can still be used afterwards.)
+void cno_stream_pool_clear(struct cno_stream_pool_t *);
+
 // Begin the message exchange using the negotiated protocol.
 int cno_begin(struct cno_connection_t *, enum CNO_HTTP_VERSION);
 
-// Handle some new data from the transport level.
+// Handle some new data from the transport level. Complete frames (and HTTP 1 payload)
+// are parsed in place, so pointers passed to callbacks may point into this buffer.
 int cno_consume(struct cno_connection_t *, const char *, size_t);
 
+// Delay output until the matching `cno_uncork`, then emit it with one `on_writev`.
+// Calls can be nested. `cno_consume` and the `cno_write_*` functions do this implicitly,
+// so this is only needed to batch several writes made outside of callbacks.
+void cno_cork(struct cno_connection_t *);
+
+// Undo one `cno_cork`; the outermost call sends everything queued since.
+int cno_uncork(struct cno_connection_t *);
+
+// Release memory an idle connection does not need: empty buffers, the stream table if no
+// streams are open, pooled stream objects, and, if `hpack` is nonzero, the slack in both
+// dynamic tables. Everything is allocated again on demand. Must not be called while corked
+// (in particular, from a callback).
+int cno_hibernate(struct cno_connection_t *, int hpack);
+
+// Break down the memory used by a connection. The sizes are those requested from the allocator,
+// so its own overhead is not included.
+void cno_memory_usage(const struct cno_connection_t *, struct cno_memory_usage_t *);
+
 // Handle an EOF from a half-closed transport. (After calling this, wait for remaining
 // streams to end, then close the write half as well.)
 int cno_eof(struct cno_connection_t *);
@@ -218,6 +357,18 @@ uint32_t cno_next_stream(const struct cno_connection_t *);
 // or `on_upgrade` of an HTTP 1 connection; see `on_upgrade`.
 int cno_write_head(struct cno_connection_t *, uint32_t stream, const struct cno_message_t *, int final);
 
+// Same as `cno_write_head`, but also send headers from a set after `msg->headers`.
+int cno_write_head_set(struct cno_connection_t *, uint32_t stream, const struct cno_message_t *,
+                       const struct cno_header_set_t *, int final);
+
+// Validate and prepare a list of headers. The set does not reference the list afterwards.
+// Its memory comes from the allocator (NULL means the C library's), which must outlive it.
+int cno_header_set_init(struct cno_header_set_t *, const struct cno_allocator_t *,
+                        const struct cno_header_t *, size_t n);
+
+// Free all resources associated with a header set.
+void cno_header_set_clear(struct cno_header_set_t *);
+
 // Server: initiate a request in anticipation of the client doing it anyway. This should
 // only be done for safe requests without payload. The function will silently do nothing
 // if the client uses HTTP 1 or has specified that it does not want push messages.
@@ -229,6 +380,24 @@ int cno_write_push(struct cno_connection_t *, uint32_t stream, const struct cno_
 // the same stream (or on stream 0) before retrying.
 int cno_write_data(struct cno_connection_t *, uint32_t stream, const char *, size_t, int final);
 
+// Same as `cno_write_data`, but the payload is the concatenation of `n` buffers. In HTTP 2
+// mode, as few DATA frames as possible are sent; in HTTP 1 mode, one chunk. The buffers are
+// passed to `on_writev` as is, without copying, before this function returns.
+int cno_write_datav(struct cno_connection_t *, uint32_t stream, const struct cno_buffer_t *, size_t n, int final);
+
+// Same as `cno_write_data`, but send `size` bytes of an open file starting at `offset`.
+// The payload is passed to `on_writefile`, which must be set. (The file is not accessed
+// by the library itself.)
+int cno_write_file(struct cno_connection_t *, uint32_t stream, int fd, uint64_t offset, size_t size, int final);
+
+// Same as `cno_write_data`, but whatever flow control does not allow to send right away
+// is queued by reference and sent automatically as the peer opens the windows, in the order
+// chosen by the scheduler (see `cno_next_write`). Once the buffer has been sent, or
+// the stream has been reset, or the connection is destroyed with `cno_fini`, `on_data_release`
+// is called with the token. While some data is queued, `cno_write_data` must not be used
+// on the same stream, and the stream is never returned by `cno_next_write`.
+int cno_queue_data(struct cno_connection_t *, uint32_t stream, const char *, size_t, int final, void *token);
+
 // Reject a stream. Has no effect in HTTP 1 mode (in which case you should simply
 // close the transport) or if the stream has already finished because a response
 // or another reset has been received/sent.
@@ -242,12 +411,51 @@ int cno_write_ping(struct cno_connection_t *, const char[8]);
 int cno_write_frame(struct cno_connection_t *, const struct cno_frame_t *);
 
 // Increase the flow window by the specified amount, allowing the peer to send more data.
+// Stream 0 is the connection-wide window.
 //
 // NOTE: if manual flow control is disabled, the window size is kept constant by increasing
-//       it before emitting `on_message_data`. This function can still be used to make
-//       the window bigger than the default.
+//       it after emitting `on_message_data`. This function can still be used to make
+//       the window bigger than the default. Either way, the peer is only notified once
+//       enough has accumulated; see `window_update_percent`. (Except when making
+//       the connection window bigger, which takes effect immediately.)
 int cno_open_flow(struct cno_connection_t *, uint32_t stream, uint32_t delta);
 
+// Mark a stream as having (or no longer having) data to send. Streams are unmarked
+// automatically once they end or their final DATA is written. See `cno_next_write`.
+int cno_want_write(struct cno_connection_t *, uint32_t stream, int);
+
+// Override a stream's priority: urgency 0 (highest) to 7, and whether the response is
+// useful when received in pieces. By default, servers use what the client signals with
+// the `priority` header, PRIORITY_UPDATE frames, or (failing that) RFC 7540 weights.
+int cno_set_priority(struct cno_connection_t *, uint32_t stream, uint8_t urgency, int incremental);
+
+// Pick which of the streams marked with `cno_want_write` to write to next, and how many
+// bytes of DATA to give it (the flow control windows permit at least that many). Returns
+// 0 if there is nothing that can be written right now.
+uint32_t cno_next_write(struct cno_connection_t *, size_t *limit);
+
+// Streams can also be referred to by handle, which avoids looking them up by id. A handle
+// is valid from `on_stream_start` until `on_stream_end` (or `on_stream_close`) and must
+// not be used after that. Returns NULL if there is no such stream.
+struct cno_stream_t *cno_stream_get(struct cno_connection_t *, uint32_t stream);
+
+uint32_t cno_stream_id(const struct cno_stream_t *);
+
+// Attach an arbitrary pointer to a stream, e.g. in `on_stream_start`. The library does
+// not touch it other than to pass it to `on_stream_data` and `on_stream_close`.
+void cno_stream_set_data(struct cno_stream_t *, void *);
+void *cno_stream_data(const struct cno_stream_t *);
+
+// Same as the id-based functions above.
+int cno_stream_write_head(struct cno_connection_t *, struct cno_stream_t *, const struct cno_message_t *,
+                          const struct cno_header_set_t *, int final);
+int cno_stream_write_data(struct cno_connection_t *, struct cno_stream_t *, const char *, size_t, int final);
+int cno_stream_write_datav(struct cno_connection_t *, struct cno_stream_t *, const struct cno_buffer_t *, size_t n, int final);
+int cno_stream_write_file(struct cno_connection_t *, struct cno_stream_t *, int fd, uint64_t offset, size_t size, int final);
+int cno_stream_queue_data(struct cno_connection_t *, struct cno_stream_t *, const char *, size_t, int final, void *token);
+int cno_stream_write_reset(struct cno_connection_t *, struct cno_stream_t *, enum CNO_RST_STREAM_CODE);
+int cno_stream_open_flow(struct cno_connection_t *, struct cno_stream_t *, uint32_t delta);
+
 #if !CFFI_CDEF_MODE
 // Deprecated aliases {
 static inline void __attribute__((deprecated("-> cno_init"))) cno_connection_init(struct cno_connection_t *c, enum CNO_CONNECTION_KIND k) {
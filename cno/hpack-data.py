@@ -3,12 +3,19 @@ import textwrap
 import itertools
 
 
-#    1 2 . 4 . . . 8 <-- impossible
-#    ^     ^
-# slow     +14 KB worth of constants but faster
-HUFFMAN_INPUT_BITS = 4
+#    1 2 . 4 . . . 8 . . . . . . . 16 <-- 256 states * 64K transitions, too big
+#    ^     ^       ^
+# slow     |       +256 KB; one table lookup per input byte, emits up to 2 bytes each
+#          +16 KB; two lookups per input byte
+HUFFMAN_INPUT_BITS = 8
 HUFFMAN_ACCEPT = 0x01
-HUFFMAN_APPEND = 0x02
+HUFFMAN_FAIL   = 0x02
+HUFFMAN_APPEND = 0x04  # multiplied by the number of decoded bytes
+
+#    6 7 8 <-- 2^N slots for 52 distinct static table names
+#    ^   ^
+# slow   fast to generate (the search for a seed without collisions, that is)
+STATIC_HASH_BITS = 8
 
 
 HUFFMAN = [  # char code -> (right-aligned huffman code, bit length)
@@ -116,10 +123,14 @@ STATIC_TABLE = [
 
 def huffman_dfa(table, bits_per_step):
     '''
-        Initial state:    `(0, 0, HUFFMAN_ACCEPT)`
-        Transition rule:  `state = states[state.next | N_more_bits_of_input]`
+        Initial state:    `(0, HUFFMAN_ACCEPT, ...)`
+        Transition rule:  `state = states[state.next << N | N_more_bits_of_input]`
         Accepting states: `state.flags & HUFFMAN_ACCEPT`
-        Decoded a byte:   `state.flags & HUFFMAN_APPEND`
+        Decoded bytes:    `state.bytes[:state.flags // HUFFMAN_APPEND]`
+        Invalid input:    `state.flags & HUFFMAN_FAIL` at any step
+
+        Yields `(next, [bytes], flags)`. After an invalid code (i.e. EOS), decoding
+        restarts from the root, so the error must be remembered by the caller.
     '''
     def branch(xs):
         if not xs:
@@ -143,23 +154,61 @@ def huffman_dfa(table, bits_per_step):
     states = [root]
     for state in states:
         for bits in itertools.product((0, 1), repeat=bits_per_step):
-            char, next = None, state
+            chars, next, fail = [], state, False
 
             for bit in bits:
+                next = next[bit]
                 if next is None:
+                    chars, next, fail = [], root, True
                     break
-
-                next = next[bit]
                 if isinstance(next, int):
-                    assert char is None, 'a single step would yield multiple characters'
-                    char, next = next, root
+                    chars.append(next)
+                    next = root
 
             if next not in states:
                 states.append(next)
 
-            yield (states.index(next) << bits_per_step, char or 0,
+            yield (states.index(next), chars,
                 HUFFMAN_ACCEPT * (next in accept) |
-                HUFFMAN_APPEND * (char is not None))
+                HUFFMAN_FAIL   * fail |
+                HUFFMAN_APPEND * len(chars))
+
+    assert len(states) <= 256, 'state ids do not fit into a byte'
+
+
+def fnv1a(data, seed):
+    # Must match `cno_hpack_hash` in hpack.c.
+    for c in data.encode('utf-8'):
+        seed = ((seed ^ c) * 16777619) & 0xFFFFFFFF
+    return seed
+
+
+def static_table_hash(table, bits):
+    '''
+        Find a seed for which FNV-1a maps each distinct name to its own slot, then return
+        `(seed, [(index of the first entry with that name or 0, number of such entries)])`.
+        Entries with the same name are adjacent, so a full match only needs to check those.
+    '''
+    names = [k for i, (k, _) in enumerate(table) if not i or table[i - 1][0] != k]
+    assert len(names) == len(set(names)), 'entries with the same name are not adjacent'
+
+    for seed in itertools.count(2166136261):
+        slots = {fnv1a(k, seed) >> (32 - bits): k for k in names}
+        if len(slots) == len(names):
+            break
+
+    result = [(0, 0)] * (1 << bits)
+    for slot, name in slots.items():
+        index = next(i for i, (k, _) in enumerate(table) if k == name)
+        result[slot] = (index + 1, sum(k == name for k, _ in table))
+    return seed, result
+
+
+STATIC_HASH_SEED, STATIC_HASH = static_table_hash(STATIC_TABLE, STATIC_HASH_BITS)
+
+
+HUFFMAN_DFA = list(huffman_dfa(HUFFMAN, HUFFMAN_INPUT_BITS))
+HUFFMAN_MAX_OUTPUT = max(len(chars) for _, chars, _ in HUFFMAN_DFA)
 
 
 with open(os.path.join(os.path.dirname(__file__), 'hpack-data.h'), 'w') as fd:
@@ -167,25 +216,34 @@ with open(os.path.join(os.path.dirname(__file__), 'hpack-data.h'), 'w') as fd:
         '#pragma once\n' + textwrap.dedent('''
         // make cno/hpack-data.h
         struct cno_huffman_table_t {{ uint32_t code; uint8_t bits; }};
-        struct cno_huffman_state_t {{ uint16_t next; uint8_t byte; uint8_t flags; }};
+        struct cno_huffman_state_t {{ uint8_t next; uint8_t flags; uint8_t bytes[{}]; }};
+        struct cno_hpack_static_name_t {{ uint8_t index; uint8_t count; }};
 
         enum {{
             CNO_HPACK_STATIC_TABLE_SIZE = {},
             CNO_HUFFMAN_ACCEPT = {},
+            CNO_HUFFMAN_FAIL = {},
             CNO_HUFFMAN_APPEND = {},
             CNO_HUFFMAN_INPUT_BITS = {},
+            CNO_HUFFMAN_MAX_OUTPUT = {},
             CNO_HUFFMAN_MIN_BITS_PER_CHAR = {},
+            CNO_HPACK_STATIC_HASH_BITS = {},
         }};
 
+        static const uint32_t CNO_HPACK_STATIC_HASH_SEED = {}u;
+
         static const struct cno_header_t CNO_HPACK_STATIC_TABLE[] = {{ {} }};
+        static const struct cno_hpack_static_name_t CNO_HPACK_STATIC_NAMES[] = {{ {} }};
         static const struct cno_huffman_table_t CNO_HUFFMAN_TABLE[] = {{ {} }};
         static const struct cno_huffman_state_t CNO_HUFFMAN_STATE[] = {{ {} }};
-        static const struct cno_huffman_state_t CNO_HUFFMAN_STATE_INIT = {{ 0, 0, CNO_HUFFMAN_ACCEPT }};
+        static const struct cno_huffman_state_t CNO_HUFFMAN_STATE_INIT = {{ 0, CNO_HUFFMAN_ACCEPT, {{}} }};
         ''').format(
-            len(STATIC_TABLE), HUFFMAN_ACCEPT, HUFFMAN_APPEND, HUFFMAN_INPUT_BITS,
-            min(bits for code, bits in HUFFMAN),
+            HUFFMAN_MAX_OUTPUT,
+            len(STATIC_TABLE), HUFFMAN_ACCEPT, HUFFMAN_FAIL, HUFFMAN_APPEND, HUFFMAN_INPUT_BITS, HUFFMAN_MAX_OUTPUT,
+            min(bits for code, bits in HUFFMAN), STATIC_HASH_BITS, STATIC_HASH_SEED,
             ','.join('{{"%s",%s},{"%s",%s},0}' % (k, len(k), v, len(v)) for k, v in STATIC_TABLE),
+            ','.join('{%s,%s}'    % h for h in STATIC_HASH),
             ','.join('{%s,%s}'    % h for h in HUFFMAN),
-            ','.join('{%s,%s,%s}' % h for h in huffman_dfa(HUFFMAN, HUFFMAN_INPUT_BITS)),
+            ','.join('{%s,%s,{%s}}' % (next, flags, ','.join(map(str, chars)) or 0) for next, chars, flags in HUFFMAN_DFA),
         )
     )
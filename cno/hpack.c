@@ -2,50 +2,128 @@
 #include "hpack.h"
 #include "hpack-data.h"
 
+// An entry of the dynamic table, as stored in the arena. Decoded headers may point
+// into `data` (`CNO_HEADER_REFS_TABLE`), in which case the entry is kept intact even
+// after eviction until all such headers are freed.
 struct cno_header_table_t {
-    struct cno_header_table_t *prev;
-    struct cno_header_table_t *next;
-    size_t k_size;
-    size_t v_size;
-    size_t refcnt;
+    uint32_t k_size;
+    uint32_t v_size;
+    uint32_t refcnt;
+    uint32_t offset; // from `arena->data`
     char data[];
 };
 
-void cno_hpack_free_header(struct cno_header_t *h) {
+struct cno_hpack_arena_t {
+    uint32_t cap;
+    uint32_t head; // where the next entry will be written
+    uint32_t tail; // the oldest entry that has not been reclaimed yet (possibly evicted)
+    uint32_t wrap; // if nonzero, entries occupy [tail, wrap) + [0, head); else [tail, head)
+    uint32_t pins; // sum of `refcnt` over all entries
+    uint32_t detached; // not used by any table; free once `pins` drops to 0
+    const struct cno_allocator_t *allocator;
+    char data[];
+};
+
+// Encoder-side hash chains are threaded through insertion numbers. Entries are evicted
+// in the order of insertion, so a walk can stop at the first one that is no longer in
+// the table; thus eviction does not need to unlink anything.
+struct cno_hpack_link_t {
+    uint32_t hash[2]; // of the name; of the name and the value
+    uint32_t next[2]; // older entries in the same chains
+};
+
+struct cno_hpack_name_stats_t {
+    uint8_t seen[CNO_HPACK_NAME_STATS];
+    uint8_t hits[CNO_HPACK_NAME_STATS];
+};
+
+// FNV-1a. Must match `fnv1a` in hpack-data.py, as names are also looked up in the static table.
+static inline uint32_t cno_hpack_hash(uint32_t h, const struct cno_buffer_t b) {
+    for (const uint8_t *p = (const uint8_t *) b.data, *e = p + b.size; p != e; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static inline uint32_t cno_hpack_bucket(uint32_t hash, uint32_t cap) {
+    return (hash ^ hash >> 15) & (cap - 1);
+}
+
+static inline size_t cno_hpack_entry_size(size_t k_size, size_t v_size) {
+    return (sizeof(struct cno_header_table_t) + k_size + v_size + 3) & ~(size_t) 3;
+}
+
+static inline struct cno_header_table_t *cno_hpack_entry_at(const struct cno_hpack_arena_t *a, uint32_t offset) {
+    return (struct cno_header_table_t *) &a->data[offset];
+}
+
+// Entries are numbered in order of insertion; the newest one is `state->inserted - 1`.
+static inline struct cno_header_table_t *cno_hpack_entry(const struct cno_hpack_t *state, uint32_t n) {
+    return cno_hpack_entry_at(state->arena, state->index[n & (state->index_cap - 1)]);
+}
+
+static inline int cno_hpack_is_live(const struct cno_hpack_t *state, uint32_t n) {
+    return state->inserted - n - 1 < state->count;
+}
+
+static void cno_hpack_arena_free(struct cno_hpack_arena_t *a) {
+    cno_free(a->allocator, a, sizeof(struct cno_hpack_arena_t) + a->cap);
+}
+
+static void cno_hpack_arena_release(struct cno_hpack_arena_t *a) {
+    if (a != NULL && !(a->detached = a->pins))
+        cno_hpack_arena_free(a);
+}
+
+void cno_hpack_free_header_with(const struct cno_allocator_t *a, struct cno_header_t *h) {
     if (h->flags & CNO_HEADER_OWNS_NAME)
-        free((void *) h->name.data);
+        cno_free(a, (void *) h->name.data, h->name.size);
     if (h->flags & CNO_HEADER_OWNS_VALUE)
-        free((void *) h->value.data);
+        cno_free(a, (void *) h->value.data, h->value.size);
     if (h->flags & CNO_HEADER_REFS_TABLE) {
         struct cno_header_table_t *entry = ((struct cno_header_table_t *)h->name.data) - 1;
-        if (!--entry->refcnt)
-            free(entry);
+        struct cno_hpack_arena_t *arena = (struct cno_hpack_arena_t *)
+            ((char *) entry - entry->offset - offsetof(struct cno_hpack_arena_t, data));
+        entry->refcnt--;
+        if (!--arena->pins && arena->detached)
+            cno_hpack_arena_free(arena);
     }
     *h = CNO_HEADER_EMPTY;
 }
 
+void cno_hpack_free_header(struct cno_header_t *h) {
+    cno_hpack_free_header_with(NULL, h);
+}
+
 void cno_hpack_init(struct cno_hpack_t *state, uint32_t limit) {
-    state->last = state->first = (struct cno_header_table_t *) state;
-    state->size = 0;
-    state->limit            = \
-    state->limit_upper      = \
-    state->limit_update_min = \
-    state->limit_update_end = limit;
+    *state = (struct cno_hpack_t) {
+        .limit            = limit,
+        .limit_upper      = limit,
+        .limit_update_min = limit,
+        .limit_update_end = limit,
+    };
 }
 
 static void cno_hpack_evict(struct cno_hpack_t *state, uint32_t limit) {
+    // Only the accounting is done here; the space is reclaimed by the next insertion.
     while (state->size > limit) {
-        struct cno_header_table_t *entry = state->last;
+        const struct cno_header_table_t *entry = cno_hpack_entry(state, state->inserted - state->count--);
         state->size -= entry->k_size + entry->v_size + 32;
-        entry->next->prev = entry->prev;
-        entry->prev->next = entry->next;
-        if (!--entry->refcnt)
-            free(entry);
     }
 }
 
 void cno_hpack_clear(struct cno_hpack_t *state) {
     cno_hpack_evict(state, 0);
+    cno_hpack_arena_release(state->arena);
+    cno_free(state->allocator, state->index, sizeof(uint32_t) * state->index_cap);
+    cno_free(state->allocator, state->buckets, sizeof(uint32_t) * state->index_cap * 2);
+    cno_free(state->allocator, state->links, sizeof(struct cno_hpack_link_t) * state->index_cap);
+    cno_free(state->allocator, state->name_stats, sizeof(struct cno_hpack_name_stats_t));
+    state->name_stats = NULL;
+    state->arena = NULL;
+    state->index = NULL;
+    state->index_cap = 0;
+    state->buckets = NULL;
+    state->links = NULL;
 }
 
 int cno_hpack_setlimit(struct cno_hpack_t *state, uint32_t limit) {
@@ -58,30 +136,176 @@ int cno_hpack_setlimit(struct cno_hpack_t *state, uint32_t limit) {
     return CNO_OK;
 }
 
-static int cno_hpack_insert(struct cno_hpack_t *state, const struct cno_header_t *h) {
+// Advance the arena's tail past evicted entries that are no longer referenced.
+static void cno_hpack_reclaim(struct cno_hpack_t *state) {
+    struct cno_hpack_arena_t *a = state->arena;
+    const uint32_t oldest = state->count ? state->index[(state->inserted - state->count) & (state->index_cap - 1)] : (uint32_t) -1;
+    while ((a->wrap || a->tail != a->head) && a->tail != oldest) {
+        const struct cno_header_table_t *entry = cno_hpack_entry_at(a, a->tail);
+        if (entry->refcnt)
+            break;
+        a->tail += cno_hpack_entry_size(entry->k_size, entry->v_size);
+        if (a->tail == a->wrap)
+            a->tail = a->wrap = 0;
+    }
+    if (!a->wrap && a->tail == a->head)
+        a->tail = a->head = 0;
+}
+
+// Move the live entries into a new arena of `cap` bytes, which must be enough to hold them.
+// (The old arena stays alive until no headers reference it.)
+static int cno_hpack_relocate(struct cno_hpack_t *state, size_t cap) {
+    struct cno_hpack_arena_t *a = state->arena;
+    struct cno_hpack_arena_t *b = cno_alloc(state->allocator, sizeof(struct cno_hpack_arena_t) + cap);
+    if (b == NULL)
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_hpack_arena_t) + cap);
+    *b = (struct cno_hpack_arena_t) { .cap = cap, .allocator = state->allocator };
+    for (uint32_t n = state->inserted - state->count; n != state->inserted; n++) {
+        uint32_t *offset = &state->index[n & (state->index_cap - 1)];
+        const struct cno_header_table_t *old = cno_hpack_entry_at(a, *offset);
+        struct cno_header_table_t *entry = cno_hpack_entry_at(b, *offset = b->head);
+        memcpy(entry, old, sizeof(struct cno_header_table_t) + old->k_size + old->v_size);
+        entry->refcnt = 0;
+        entry->offset = b->head;
+        b->head += cno_hpack_entry_size(old->k_size, old->v_size);
+    }
+    cno_hpack_arena_release(a);
+    state->arena = b;
+    return CNO_OK;
+}
+
+// Find `size` contiguous bytes in the arena, moving the live entries into a bigger one
+// if there is not enough space.
+static struct cno_header_table_t *cno_hpack_reserve(struct cno_hpack_t *state, size_t size) {
+    struct cno_hpack_arena_t *a = state->arena;
+    if (a != NULL) {
+        cno_hpack_reclaim(state);
+        if (a->wrap ? a->tail - a->head >= size : a->cap - a->head >= size)
+            return cno_hpack_entry_at(a, a->head);
+        if (!a->wrap && a->tail >= size) {
+            a->wrap = a->head;
+            a->head = 0;
+            return cno_hpack_entry_at(a, 0);
+        }
+    }
+
+    size_t used = size;
+    for (uint32_t n = state->inserted - state->count; n != state->inserted; n++) {
+        const struct cno_header_table_t *entry = cno_hpack_entry(state, n);
+        used += cno_hpack_entry_size(entry->k_size, entry->v_size);
+    }
+    size_t cap = a ? a->cap * 2 : 256;
+    if (cap < used * 2)
+        cap = used * 2;
+    if (cap > UINT32_MAX)
+        return CNO_ERROR(NO_MEMORY, "dynamic table too big"), NULL;
+    if (cno_hpack_relocate(state, cap))
+        return NULL;
+    return cno_hpack_entry_at(state->arena, state->arena->head);
+}
+
+static void cno_hpack_link(struct cno_hpack_t *state, uint32_t n, const uint32_t hash[2]) {
+    struct cno_hpack_link_t *link = &state->links[n & (state->index_cap - 1)];
+    for (int k = 0; k < 2; k++) {
+        uint32_t *head = &state->buckets[state->index_cap * k + cno_hpack_bucket(hash[k], state->index_cap)];
+        link->hash[k] = hash[k];
+        link->next[k] = *head;
+        *head = n;
+    }
+}
+
+// Change the capacity of the index (a power of 2, at least `state->count`) and, if `hashed`,
+// rebuild the hash chains to match. There can be at most `limit / 32` entries, so this only
+// grows during warm-up.
+static int cno_hpack_resize(struct cno_hpack_t *state, uint32_t cap, int hashed) {
+    const struct cno_allocator_t *a = state->allocator;
+    uint32_t *index = cno_alloc(a, sizeof(uint32_t) * cap);
+    uint32_t *buckets = hashed ? cno_alloc(a, sizeof(uint32_t) * cap * 2) : NULL;
+    struct cno_hpack_link_t *links = hashed ? cno_alloc(a, sizeof(struct cno_hpack_link_t) * cap) : NULL;
+    if (index == NULL || (hashed && (buckets == NULL || links == NULL))) {
+        cno_free(a, index, sizeof(uint32_t) * cap);
+        cno_free(a, buckets, sizeof(uint32_t) * cap * 2);
+        cno_free(a, links, sizeof(struct cno_hpack_link_t) * cap);
+        return CNO_ERROR(NO_MEMORY, "index of %u entries", cap);
+    }
+
+    struct cno_hpack_t old = *state;
+    state->index = index;
+    state->index_cap = cap;
+    state->buckets = buckets;
+    state->links = links;
+    // Any entry older than the oldest one is a valid chain terminator.
+    for (uint32_t i = 0; hashed && i < cap * 2; i++)
+        buckets[i] = state->inserted - state->count - 1;
+    for (uint32_t n = state->inserted - state->count; n != state->inserted; n++) {
+        index[n & (cap - 1)] = old.index[n & (old.index_cap - 1)];
+        if (hashed)
+            cno_hpack_link(state, n, old.links[n & (old.index_cap - 1)].hash);
+    }
+    cno_free(a, old.index, sizeof(uint32_t) * old.index_cap);
+    cno_free(a, old.buckets, sizeof(uint32_t) * old.index_cap * 2);
+    cno_free(a, old.links, sizeof(struct cno_hpack_link_t) * old.index_cap);
+    return CNO_OK;
+}
+
+// `hash` is only given by an encoder; see `cno_hpack_lookup_inverse`.
+static int cno_hpack_insert(struct cno_hpack_t *state, const struct cno_header_t *h, const uint32_t *hash) {
     size_t recorded = h->name.size + h->value.size + 32;
     if (recorded > state->limit) {
         cno_hpack_evict(state, 0);
-    } else {
-        cno_hpack_evict(state, state->limit - recorded);
-
-        size_t actual = h->name.size + h->value.size + sizeof(struct cno_header_table_t);
-        struct cno_header_table_t *entry = malloc(actual);
-        if (entry == NULL)
-            return CNO_ERROR(NO_MEMORY, "%zu bytes", actual);
-
-        memcpy(&entry->data[0],            h->name.data,  entry->k_size = h->name.size);
-        memcpy(&entry->data[h->name.size], h->value.data, entry->v_size = h->value.size);
-        entry->refcnt = 1;
-        entry->prev = (struct cno_header_table_t *) state;
-        entry->next = state->first;
-        state->first->prev = entry;
-        state->first = entry;
-        state->size += recorded;
+        return CNO_OK;
     }
+    cno_hpack_evict(state, state->limit - recorded);
+
+    if (state->count == state->index_cap
+     && cno_hpack_resize(state, state->index_cap ? state->index_cap * 2 : 16, hash != NULL))
+        return CNO_ERROR_UP();
+
+    // Note that `h` may point into an evicted entry; `cno_hpack_reclaim` won't touch it though.
+    struct cno_header_table_t *entry = cno_hpack_reserve(state, cno_hpack_entry_size(h->name.size, h->value.size));
+    if (entry == NULL)
+        return CNO_ERROR_UP();
+
+    struct cno_hpack_arena_t *a = state->arena;
+    memcpy(&entry->data[0],            h->name.data,  entry->k_size = h->name.size);
+    memcpy(&entry->data[h->name.size], h->value.data, entry->v_size = h->value.size);
+    entry->refcnt = 0;
+    entry->offset = a->head;
+    a->head += cno_hpack_entry_size(h->name.size, h->value.size);
+    state->index[state->inserted & (state->index_cap - 1)] = entry->offset;
+    if (hash != NULL)
+        cno_hpack_link(state, state->inserted, hash);
+    state->inserted++;
+    state->count++;
+    state->size += recorded;
     return CNO_OK;
 }
 
+int cno_hpack_compact(struct cno_hpack_t *state) {
+    if (!state->count) {
+        cno_hpack_clear(state);
+        return CNO_OK;
+    }
+    uint32_t cap = 16;
+    while (cap < state->count)
+        cap *= 2;
+    if (cap < state->index_cap && cno_hpack_resize(state, cap, state->buckets != NULL))
+        return CNO_ERROR_UP();
+    size_t used = 0;
+    for (uint32_t n = state->inserted - state->count; n != state->inserted; n++) {
+        const struct cno_header_table_t *entry = cno_hpack_entry(state, n);
+        used += cno_hpack_entry_size(entry->k_size, entry->v_size);
+    }
+    return used < state->arena->cap && cno_hpack_relocate(state, used) ? CNO_ERROR_UP() : CNO_OK;
+}
+
+size_t cno_hpack_memory_usage(const struct cno_hpack_t *state) {
+    return (state->arena ? sizeof(struct cno_hpack_arena_t) + state->arena->cap : 0)
+         + sizeof(uint32_t) * state->index_cap
+         + (state->buckets ? (sizeof(uint32_t) * 2 + sizeof(struct cno_hpack_link_t)) * state->index_cap : 0)
+         + (state->name_stats ? sizeof(struct cno_hpack_name_stats_t) : 0);
+}
+
 static int cno_hpack_lookup(struct cno_hpack_t *state, size_t index, struct cno_header_t *out) {
     if (index == 0)
         return CNO_ERROR(PROTOCOL, "header index 0 is reserved");
@@ -92,38 +316,56 @@ static int cno_hpack_lookup(struct cno_hpack_t *state, size_t index, struct cno_
         return CNO_OK;
     }
 
-    struct cno_header_table_t *hdr = (struct cno_header_table_t *) state;
-    for (index -= CNO_HPACK_STATIC_TABLE_SIZE; index--;)
-        if ((hdr = hdr->next) == (struct cno_header_table_t *) state)
-            return CNO_ERROR(PROTOCOL, "dynamic table index out of bounds");
+    if ((index -= CNO_HPACK_STATIC_TABLE_SIZE) > state->count)
+        return CNO_ERROR(PROTOCOL, "dynamic table index out of bounds");
 
-    out->name  = (struct cno_buffer_t){ &hdr->data[0], hdr->k_size };
-    out->value = (struct cno_buffer_t){ &hdr->data[hdr->k_size], hdr->v_size };
+    struct cno_header_table_t *entry = cno_hpack_entry(state, state->inserted - index);
+    out->name  = (struct cno_buffer_t){ &entry->data[0], entry->k_size };
+    out->value = (struct cno_buffer_t){ &entry->data[entry->k_size], entry->v_size };
     out->flags |= CNO_HEADER_REFS_TABLE;
-    hdr->refcnt++;
+    entry->refcnt++;
+    state->arena->pins++;
     return CNO_OK;
 }
 
 // Return value is either 0 (not found), index (name match), or -index (full match).
-static int cno_hpack_lookup_inverse(struct cno_hpack_t *state, const struct cno_header_t *needle) {
-#define TRY(k, v) do {                   \
-    if (!cno_buffer_eq(needle->name, k)) \
-        break;                           \
-    if (cno_buffer_eq(needle->value, v)) \
-        return -i;                       \
-    if (possible == 0)                   \
-        possible = i;                    \
-} while (0)
-
-    int i = 1, possible = 0;
-    for (const struct cno_header_t *h = CNO_HPACK_STATIC_TABLE; i <= CNO_HPACK_STATIC_TABLE_SIZE; ++h, ++i)
-        TRY(h->name, h->value);
-    for (const struct cno_header_table_t *t = state->first; t != (struct cno_header_table_t *) state; t = t->next, ++i)
-        TRY(((struct cno_buffer_t) { &t->data[0], t->k_size }),
-            ((struct cno_buffer_t) { &t->data[t->k_size], t->v_size }));
-    return possible;
+// `hash` is set to what `cno_hpack_insert` needs to index the header.
+static int cno_hpack_lookup_static(const struct cno_header_t *needle, uint32_t hash[2]) {
+    hash[0] = cno_hpack_hash(CNO_HPACK_STATIC_HASH_SEED, needle->name);
+    hash[1] = cno_hpack_hash(hash[0], needle->value);
+
+    // Entries with the same name are adjacent, and the names themselves hash perfectly.
+    const struct cno_hpack_static_name_t s = CNO_HPACK_STATIC_NAMES[hash[0] >> (32 - CNO_HPACK_STATIC_HASH_BITS)];
+    if (!s.index || !cno_buffer_eq(needle->name, CNO_HPACK_STATIC_TABLE[s.index - 1].name))
+        return 0;
+    for (int i = s.index; i < s.index + s.count; i++)
+        if (cno_buffer_eq(needle->value, CNO_HPACK_STATIC_TABLE[i - 1].value))
+            return -i;
+    return s.index;
+}
 
-#undef TRY
+// Same, but in both tables; `possible` is what `cno_hpack_lookup_static` returned.
+static int cno_hpack_lookup_inverse(const struct cno_hpack_t *state, const struct cno_header_t *needle,
+                                    const uint32_t hash[2], int possible)
+{
+    if (possible < 0 || state->links == NULL)
+        return possible;
+
+    for (int k = 1; k >= (possible ? 1 : 0); k--) {
+        const uint32_t *head = &state->buckets[state->index_cap * k + cno_hpack_bucket(hash[k], state->index_cap)];
+        for (uint32_t n = *head; cno_hpack_is_live(state, n); n = state->links[n & (state->index_cap - 1)].next[k]) {
+            if (state->links[n & (state->index_cap - 1)].hash[k] != hash[k])
+                continue;
+            const struct cno_header_table_t *t = cno_hpack_entry(state, n);
+            if (!cno_buffer_eq(needle->name, (struct cno_buffer_t) { &t->data[0], t->k_size }))
+                continue;
+            if (k == 0)
+                return CNO_HPACK_STATIC_TABLE_SIZE + (int) (state->inserted - n);
+            if (cno_buffer_eq(needle->value, (struct cno_buffer_t) { &t->data[t->k_size], t->v_size }))
+                return -(CNO_HPACK_STATIC_TABLE_SIZE + (int) (state->inserted - n));
+        }
+    }
+    return possible;
 }
 
 // Format: the value as 1 byte if less than mask, else {mask, 0x80 | <7 bits>, ..., <last 7 bits>} (little-endian).
@@ -149,8 +391,18 @@ static int cno_hpack_decode_uint(struct cno_buffer_t *source, uint8_t mask, size
     return CNO_OK;
 }
 
+// How much space the decoder needs for a Huffman-coded string of `n` octets. The last
+// few bytes are scratch space: each step writes all of `state.bytes` even if unused.
+static inline size_t cno_hpack_huffman_bound(size_t n) {
+    return n * 8 / CNO_HUFFMAN_MIN_BITS_PER_CHAR + CNO_HUFFMAN_MAX_OUTPUT;
+}
+
 // Format: 1 bit is a flag for Huffman encoding, then a varint for length, then raw data.
-static int cno_hpack_decode_string(struct cno_buffer_t *source, struct cno_buffer_t *out, int *borrow) {
+// If `arena` is not NULL, it must have enough space reserved for the decoded string.
+// Otherwise, Huffman-coded strings are allocated with `a`.
+static int cno_hpack_decode_string(struct cno_buffer_t *source, struct cno_buffer_t *out, int *borrow,
+                                   struct cno_buffer_dyn_t *arena, const struct cno_allocator_t *a)
+{
     if (!source->size)
         return CNO_ERROR(PROTOCOL, "expected string, got EOF");
     const uint8_t huffman = (* (const uint8_t *) source->data) & 0x80;
@@ -162,28 +414,57 @@ static int cno_hpack_decode_string(struct cno_buffer_t *source, struct cno_buffe
         return CNO_ERROR(PROTOCOL, "expected %zu octets, got %zu", length, source->size);
 
     if (length && huffman) {
-        uint8_t *buf = malloc(length * 8 / CNO_HUFFMAN_MIN_BITS_PER_CHAR);
+        const size_t bound = cno_hpack_huffman_bound(length);
+        uint8_t *buf = arena ? (uint8_t *) arena->data + arena->size : cno_alloc(a, bound);
         uint8_t *ptr = buf;
         if (!buf)
-            return CNO_ERROR(NO_MEMORY, "%zu bytes", length * 2);
+            return CNO_ERROR(NO_MEMORY, "%zu bytes", bound);
 
+        // No branches in the loop: the table says how many of the bytes to keep, and
+        // whether an error occurred is checked only once at the end.
         struct cno_huffman_state_t state = CNO_HUFFMAN_STATE_INIT;
+        uint8_t flags = 0;
         for (const uint8_t *p = (const uint8_t *) source->data, *e = length + p; p != e; p++) {
-            uint8_t chr = *p;
-            for (int i = 0; i < 8; i += CNO_HUFFMAN_INPUT_BITS, chr <<= CNO_HUFFMAN_INPUT_BITS) {
-                state = CNO_HUFFMAN_STATE[state.next | (chr >> (8 - CNO_HUFFMAN_INPUT_BITS))];
-                if (state.flags & CNO_HUFFMAN_APPEND)
-                    *ptr++ = state.byte;
+            unsigned chr = *p;
+            for (int i = 0; i < 8; i += CNO_HUFFMAN_INPUT_BITS, chr = (chr << CNO_HUFFMAN_INPUT_BITS) & 0xFF) {
+                state = CNO_HUFFMAN_STATE[state.next << CNO_HUFFMAN_INPUT_BITS | chr >> (8 - CNO_HUFFMAN_INPUT_BITS)];
+                memcpy(ptr, state.bytes, CNO_HUFFMAN_MAX_OUTPUT);
+                ptr   += state.flags / CNO_HUFFMAN_APPEND;
+                flags |= state.flags;
             }
         }
 
-        if (!(state.flags & CNO_HUFFMAN_ACCEPT)) {
-            free(buf);
+        if ((flags & CNO_HUFFMAN_FAIL) || !(state.flags & CNO_HUFFMAN_ACCEPT)) {
+            if (!arena)
+                cno_free(a, buf, bound);
             return CNO_ERROR(PROTOCOL, "invalid or truncated Huffman code");
         }
 
         out->data = (char *) buf;
         out->size = ptr - buf;
+        if (!arena && a && out->size != bound) {
+            // `cno_hpack_free_header_with` only knows the decoded size. (The C library's
+            // `free` needs no size, so the default allocator skips this.)
+            if (!out->size) {
+                cno_free(a, buf, bound);
+                out->data = "";
+                *borrow = 1;
+            } else if (!(out->data = cno_realloc(a, buf, bound, out->size))) {
+                cno_free(a, buf, bound);
+                return CNO_ERROR(NO_MEMORY, "%zu bytes", out->size);
+            }
+        }
+        if (arena) {
+            arena->size += out->size;
+            *borrow = 1;
+        }
+    } else if (arena) {
+        // Raw strings are copied too, so that the source can be a transient fragment.
+        memcpy(arena->data + arena->size, source->data, length);
+        out->data = arena->data + arena->size;
+        out->size = length;
+        arena->size += length;
+        *borrow = 1;
     } else {
         out->data = source->data;
         out->size = length;
@@ -194,9 +475,10 @@ static int cno_hpack_decode_string(struct cno_buffer_t *source, struct cno_buffe
     return CNO_OK;
 }
 
-static int cno_hpack_decode_one(struct cno_hpack_t  *state,
-                                struct cno_buffer_t *source,
-                                struct cno_header_t *target)
+static int cno_hpack_decode_one(struct cno_hpack_t     *state,
+                                struct cno_buffer_t    *source,
+                                struct cno_header_t    *target,
+                                struct cno_buffer_dyn_t *arena)
 {
     *target = CNO_HEADER_EMPTY;
 
@@ -223,7 +505,7 @@ static int cno_hpack_decode_one(struct cno_hpack_t  *state,
 
     if (index == 0) {
         int borrow = 0;
-        if (cno_hpack_decode_string(source, &target->name, &borrow))
+        if (cno_hpack_decode_string(source, &target->name, &borrow, arena, state->allocator))
             return CNO_ERROR_UP();
         if (!borrow)
             target->flags |= CNO_HEADER_OWNS_NAME;
@@ -233,15 +515,21 @@ static int cno_hpack_decode_one(struct cno_hpack_t  *state,
     }
 
     int borrow = 0;
-    if (cno_hpack_decode_string(source, &target->value, &borrow))
+    if (cno_hpack_decode_string(source, &target->value, &borrow, arena, state->allocator))
         return CNO_ERROR_UP();
     if (!borrow)
         target->flags |= CNO_HEADER_OWNS_VALUE;
 
-    return target->flags & CNO_HEADER_NOT_INDEXED ? CNO_OK : cno_hpack_insert(state, target);
+    return target->flags & CNO_HEADER_NOT_INDEXED ? CNO_OK : cno_hpack_insert(state, target, NULL);
 }
 
-int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t buf, struct cno_header_t *rs, size_t *n) {
+int cno_hpack_decode_into(struct cno_hpack_t *state, struct cno_buffer_dyn_t *arena,
+                          struct cno_buffer_t buf, struct cno_header_t *rs, size_t *n)
+{
+    // Reserving the worst case for the entire block upfront means none of the strings move.
+    if (arena && cno_buffer_dyn_reserve_with(state->allocator, arena, arena->size + cno_hpack_huffman_bound(buf.size)))
+        return CNO_ERROR_UP();
+
     while (buf.size && ((* (const uint8_t *) buf.data) & 0xE0) == 0x20) {
         // 001..... -- a new size limit for the table
         size_t limit = 0;
@@ -255,11 +543,11 @@ int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t buf, struct
 
     size_t read = 0, limit = *n;
     for (; buf.size; rs++, read++) {
-        if (read == limit || cno_hpack_decode_one(state, &buf, rs)) {
+        if (read == limit || cno_hpack_decode_one(state, &buf, rs, arena)) {
             if (read != limit)
-                cno_hpack_free_header(rs);
+                cno_hpack_free_header_with(state->allocator, rs);
             while (read--)
-                cno_hpack_free_header(--rs);
+                cno_hpack_free_header_with(state->allocator, --rs);
             return read == limit ? CNO_ERROR(PROTOCOL, "header list too long") : CNO_ERROR_UP();
         }
     }
@@ -267,76 +555,255 @@ int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t buf, struct
     return CNO_OK;
 }
 
-static int cno_hpack_encode_uint(struct cno_buffer_dyn_t *buf, uint8_t prefix, uint8_t mask, size_t num) {
+// Whether `buf` starts with an entire representation. (If it's malformed, `cno_hpack_decode_one`
+// will report that once the block is complete, so it's also considered incomplete here.)
+static int cno_hpack_is_complete(struct cno_buffer_t buf) {
+    const uint8_t head = * (const uint8_t *) buf.data;
+    size_t index = 0, length = 0;
+    if (cno_hpack_decode_uint(&buf, head >= 0x80 ? 0x7F : head >= 0x40 ? 0x3F : head >= 0x20 ? 0x1F : 0x0F, &index))
+        return 0;
+    if (head >= 0x80 || (head & 0xE0) == 0x20)
+        return 1;
+    if (index == 0) {
+        if (cno_hpack_decode_uint(&buf, 0x7F, &length) || length > buf.size)
+            return 0;
+        buf = cno_buffer_shift(buf, length);
+    }
+    return !cno_hpack_decode_uint(&buf, 0x7F, &length) && length <= buf.size;
+}
+
+int cno_hpack_decode_fragment(struct cno_hpack_t *state, struct cno_buffer_dyn_t *arena,
+                              struct cno_buffer_dyn_t *out, struct cno_buffer_t *buf)
+{
+    // Unlike in `cno_hpack_decode_into`, the arena may move, so the strings of headers
+    // decoded from previous fragments have to follow it.
+    const uintptr_t old = (uintptr_t) arena->data;
+    if (cno_buffer_dyn_reserve_with(state->allocator, arena, arena->size + cno_hpack_huffman_bound(buf->size)))
+        return CNO_ERROR_UP();
+    if (old != (uintptr_t) arena->data) {
+        struct cno_header_t *it = (struct cno_header_t *) out->data;
+        for (struct cno_header_t *end = it + out->size / sizeof(*it); it != end; it++) {
+            if ((uintptr_t) it->name.data - old < arena->size)
+                it->name.data = arena->data + ((uintptr_t) it->name.data - old);
+            if ((uintptr_t) it->value.data - old < arena->size)
+                it->value.data = arena->data + ((uintptr_t) it->value.data - old);
+        }
+    }
+
+    while (!out->size && buf->size && ((* (const uint8_t *) buf->data) & 0xE0) == 0x20 && cno_hpack_is_complete(*buf)) {
+        size_t limit = 0;
+        if (cno_hpack_decode_uint(buf, 0x1F, &limit))
+            return CNO_ERROR_UP();
+        cno_hpack_evict(state, state->limit = limit);
+    }
+
+    if (state->limit > state->limit_upper)
+        return CNO_ERROR(PROTOCOL, "current decoder state size limit is higher than the upper bound");
+
+    while (buf->size && cno_hpack_is_complete(*buf)) {
+        if (cno_buffer_dyn_reserve_with(state->allocator, out, out->size + sizeof(struct cno_header_t)))
+            return CNO_ERROR_UP();
+        struct cno_header_t *h = (struct cno_header_t *) (out->data + out->size);
+        if (cno_hpack_decode_one(state, buf, h, arena))
+            return cno_hpack_free_header_with(state->allocator, h), CNO_ERROR_UP();
+        out->size += sizeof(struct cno_header_t);
+    }
+    return CNO_OK;
+}
+
+int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t buf, struct cno_header_t *rs, size_t *n) {
+    return cno_hpack_decode_into(state, NULL, buf, rs, n);
+}
+
+// Same format as above. `out` must have space for `sizeof(num) * 2` bytes; returns the used size.
+static size_t cno_hpack_write_uint(uint8_t *out, uint8_t prefix, uint8_t mask, size_t num) {
     if (num < mask) {
-        prefix |= num;
-        return cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { (char *) &prefix, 1 });
+        *out = prefix | num;
+        return 1;
     }
 
-    uint8_t tmp[sizeof(num) * 2], *ptr = tmp;
+    uint8_t *ptr = out;
     *ptr++ = prefix | mask;
     for (num -= mask; num > 0x7F; num >>= 7)
         *ptr++ = num | 0x80;
     *ptr++ = num;
-    return cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { (char *) tmp, ptr - tmp });
+    return ptr - out;
 }
 
-static int cno_hpack_encode_string(struct cno_buffer_dyn_t *buf, const struct cno_buffer_t s) {
-    size_t total = 0;
-    for (const uint8_t *p = (const uint8_t *) s.data, *e = p + s.size; p != e; p++)
-        total += CNO_HUFFMAN_TABLE[*p].bits;
-    total = (total + 7) / 8;
+static int cno_hpack_encode_uint(const struct cno_allocator_t *a, struct cno_buffer_dyn_t *buf,
+                                 uint8_t prefix, uint8_t mask, size_t num)
+{
+    uint8_t tmp[sizeof(num) * 2];
+    return cno_buffer_dyn_concat_with(a, buf, (struct cno_buffer_t) { (char *) tmp, cno_hpack_write_uint(tmp, prefix, mask, num) });
+}
 
-    if (total >= s.size)
-        return cno_hpack_encode_uint(buf, 0, 0x7F, s.size) || cno_buffer_dyn_concat(buf, s);
+static inline void cno_hpack_write4(uint8_t *out, uint32_t x) {
+    out[0] = x >> 24;
+    out[1] = x >> 16;
+    out[2] = x >> 8;
+    out[3] = x;
+}
 
-    if (cno_hpack_encode_uint(buf, 0x80, 0x7F, total) || cno_buffer_dyn_reserve(buf, buf->size + total))
+static int cno_hpack_encode_string(const struct cno_allocator_t *a, struct cno_buffer_dyn_t *buf, const struct cno_buffer_t s) {
+    // The string is Huffman-coded straight into the space reserved for the raw form, giving
+    // up as soon as it becomes clear the result won't be shorter. The length of the coded
+    // form is then smaller too, so its prefix fits in place of the raw one. (+8 bytes are
+    // for the 32-bit stores, which may go a bit past the end.)
+    uint8_t head[sizeof(size_t) * 2];
+    size_t head_size = cno_hpack_write_uint(head, 0, 0x7F, s.size);
+    if (cno_buffer_dyn_reserve_with(a, buf, buf->size + head_size + s.size + 8))
         return CNO_ERROR_UP();
 
-    uint8_t *out = (uint8_t *) buf->data + buf->size;
+    uint8_t *start = (uint8_t *) buf->data + buf->size + head_size;
+    uint8_t *out = start, *end = start + s.size;
     uint64_t code = 0;
-    int bits = 0;
-    for (const uint8_t *p = (const uint8_t *) s.data, *e = p + s.size; p != e; p++) {
+    unsigned bits = 0;
+    const uint8_t *p = (const uint8_t *) s.data, *e = p + s.size;
+    for (; p != e && out < end; p++) {
+        // At most 31 pending bits + a 30-bit code, so nothing useful is shifted out.
         const struct cno_huffman_table_t it = CNO_HUFFMAN_TABLE[*p];
-        code  = it.code | code << it.bits;
-        bits += it.bits;
-        while (bits >= 8)
-            *out++ = code >> (bits -= 8);
+        code = code << it.bits | it.code;
+        if ((bits += it.bits) >= 32) {
+            cno_hpack_write4(out, code >> (bits -= 32));
+            out += 4;
+        }
+    }
+    if (bits) {
+        // Pad with the most significant bits of EOS, i.e. ones.
+        cno_hpack_write4(out, code << (32 - bits) | 0xFFFFFFFFu >> bits);
+        out += (bits + 7) / 8;
     }
-    if (bits)
-        *out++ = (0xff | code << 8) >> bits;
 
-    buf->size += total;
+    size_t total = out - start;
+    if (p != e || total >= s.size) {
+        memcpy(buf->data + buf->size, head, head_size);
+        memcpy(buf->data + buf->size + head_size, s.data, s.size);
+        buf->size += head_size + s.size;
+        return CNO_OK;
+    }
+
+    size_t size = cno_hpack_write_uint(head, 0x80, 0x7F, total);
+    memcpy(buf->data + buf->size, head, size);
+    if (size != head_size)
+        memmove(buf->data + buf->size + size, start, total);
+    buf->size += size + total;
     return CNO_OK;
 }
 
-static int cno_hpack_encode_one(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf, const struct cno_header_t *h) {
-    int index = cno_hpack_lookup_inverse(state, h);
+// Names whose values are unique to each message by design. Indexing them would only evict
+// something useful from the table.
+static const struct cno_buffer_t CNO_HPACK_UNIQUE_NAMES[] = {
+    { "x-request-id", 12 }, { "x-correlation-id", 16 }, { "request-id", 10 },
+    { "traceparent", 11 }, { "x-amzn-trace-id", 15 }, { "x-cloud-trace-context", 21 },
+    { "x-b3-traceid", 12 }, { "x-b3-spanid", 11 }, { "cf-ray", 6 },
+};
+
+// For other names, the fraction of occurrences that were already in the table is measured
+// over windows of 64. The first few of each window are always indexed so that a name that
+// stopped being indexed (e.g. because the table was tiny for a while) can recover.
+// (Still, if the name itself is not in either table, indexing is the only way to put it there.)
+// Without the statistics (if they could not be allocated), such names are always indexed.
+static int cno_hpack_should_index(struct cno_hpack_t *state, const struct cno_hpack_prepared_t *p, int index) {
+    struct cno_hpack_name_stats_t *stats = state->name_stats;
+    if (!stats && (stats = state->name_stats = cno_alloc(state->allocator, sizeof(*stats))) != NULL)
+        *stats = (struct cno_hpack_name_stats_t) {};
+    size_t slot = (p->hash[0] >> 16) % CNO_HPACK_NAME_STATS;
+    if (stats) {
+        if (stats->seen[slot] == 64)
+            stats->seen[slot] = stats->hits[slot] = 0;
+        stats->seen[slot]++;
+        stats->hits[slot] += index < 0;
+    }
+    if (index < 0)
+        return 0;
+    if (state->index_policy)
+        return state->index_policy(state->index_policy_data, &p->header);
+    if (index == 0)
+        return 1;
+    if (p->static_index == 0)
+        for (size_t i = 0; i < sizeof(CNO_HPACK_UNIQUE_NAMES) / sizeof(CNO_HPACK_UNIQUE_NAMES[0]); i++)
+            if (cno_buffer_eq(p->header.name, CNO_HPACK_UNIQUE_NAMES[i]))
+                return 0;
+    return !stats || stats->seen[slot] <= 8 || stats->hits[slot] * 16 >= stats->seen[slot];
+}
+
+static int cno_hpack_encode_one(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf, const struct cno_hpack_prepared_t *p) {
+    const struct cno_header_t *h = &p->header;
+    int index = cno_hpack_lookup_inverse(state, h, p->hash, p->static_index);
+    int insert = !(h->flags & CNO_HEADER_NOT_INDEXED) && cno_hpack_should_index(state, p, index);
     if (index < 0)
-        return cno_hpack_encode_uint(buf, 0x80, 0x7F, -index);
+        return cno_hpack_encode_uint(state->allocator, buf, 0x80, 0x7F, -index);
 
-    if (h->flags & CNO_HEADER_NOT_INDEXED
-        ? cno_hpack_encode_uint(buf, 0x10, 0x0F, index)
-        : cno_hpack_encode_uint(buf, 0x40, 0x3F, index) || cno_hpack_insert(state, h))
+    if (insert ? cno_hpack_encode_uint(state->allocator, buf, 0x40, 0x3F, index) || cno_hpack_insert(state, h, p->hash)
+      : h->flags & CNO_HEADER_NOT_INDEXED ? cno_hpack_encode_uint(state->allocator, buf, 0x10, 0x0F, index)
+      : cno_hpack_encode_uint(state->allocator, buf, 0x00, 0x0F, index))
             return CNO_ERROR_UP();
 
-    if (!index && cno_hpack_encode_string(buf, h->name))
+    const struct cno_allocator_t *a = state->allocator;
+    if (!index && (p->data ? cno_buffer_dyn_concat_with(a, buf, p->name_literal) : cno_hpack_encode_string(a, buf, h->name)))
         return CNO_ERROR_UP();
 
-    return cno_hpack_encode_string(buf, h->value);
+    return p->data ? cno_buffer_dyn_concat_with(a, buf, p->value_literal) : cno_hpack_encode_string(a, buf, h->value);
 }
 
-int cno_hpack_encode(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf,
-                     const struct cno_header_t *headers, size_t n)
-{
+static int cno_hpack_encode_limit_update(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf) {
     // Force the other side to evict the same number of entries first...
     if (state->limit != state->limit_update_min)
-        if (cno_hpack_encode_uint(buf, 0x20, 0x1F, state->limit = state->limit_update_min))
+        if (cno_hpack_encode_uint(state->allocator, buf, 0x20, 0x1F, state->limit = state->limit_update_min))
             return CNO_ERROR_UP();
     // ...then set the limit to its actual value.
     if (state->limit != state->limit_update_end)
-        if (cno_hpack_encode_uint(buf, 0x20, 0x1F, state->limit = state->limit_update_min = state->limit_update_end))
+        if (cno_hpack_encode_uint(state->allocator, buf, 0x20, 0x1F, state->limit = state->limit_update_min = state->limit_update_end))
+            return CNO_ERROR_UP();
+    return CNO_OK;
+}
+
+int cno_hpack_encode(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf,
+                     const struct cno_header_t *headers, size_t n)
+{
+    if (cno_hpack_encode_limit_update(state, buf))
+        return CNO_ERROR_UP();
+
+    for (struct cno_hpack_prepared_t p = {}; n--; headers++) {
+        p.header = *headers;
+        p.static_index = cno_hpack_lookup_static(headers, p.hash);
+        if (cno_hpack_encode_one(state, buf, &p))
             return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+int cno_hpack_prepare(const struct cno_allocator_t *a, struct cno_hpack_prepared_t *p, const struct cno_header_t *h) {
+    // Everything is stored in one buffer: name, value, then both as string literals.
+    struct cno_buffer_dyn_t data = {};
+    size_t name_literal = h->name.size + h->value.size, value_literal = 0;
+    if (cno_buffer_dyn_concat_with(a, &data, h->name)
+     || cno_buffer_dyn_concat_with(a, &data, h->value)
+     || cno_hpack_encode_string(a, &data, h->name)
+     || (value_literal = data.size, cno_hpack_encode_string(a, &data, h->value)))
+        return cno_buffer_dyn_clear_with(a, &data), CNO_ERROR_UP();
+
+    *p = (struct cno_hpack_prepared_t) {
+        .header        = { { data.data, h->name.size }, { data.data + h->name.size, h->value.size }, h->flags },
+        .name_literal  = { data.data + name_literal, value_literal - name_literal },
+        .value_literal = { data.data + value_literal, data.size - value_literal },
+        .data          = data.data,
+        .data_size     = data.cap,
+    };
+    p->static_index = cno_hpack_lookup_static(&p->header, p->hash);
+    return CNO_OK;
+}
+
+void cno_hpack_prepared_clear(const struct cno_allocator_t *a, struct cno_hpack_prepared_t *p) {
+    cno_free(a, p->data, p->data_size);
+    *p = (struct cno_hpack_prepared_t) {};
+}
+
+int cno_hpack_encode_prepared(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf,
+                              const struct cno_hpack_prepared_t *headers, size_t n)
+{
+    if (cno_hpack_encode_limit_update(state, buf))
+        return CNO_ERROR_UP();
 
     while (n--)
         if (cno_hpack_encode_one(state, buf, headers++))
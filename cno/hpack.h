@@ -12,7 +12,8 @@ enum CNO_HEADER_FLAGS {
     // that will never be repeated, so remembering them is pointless).
     CNO_HEADER_NOT_INDEXED = 0x04,
 
-    // These are set by `cno_hpack_decode` and should not be used manually.
+    // These are set by `cno_hpack_decode` and should not be used manually. (Owned strings
+    // come from the decoder's allocator; see `cno_hpack_free_header_with`.)
     CNO_HEADER_OWNS_NAME   = 0x01,
     CNO_HEADER_OWNS_VALUE  = 0x02,
     CNO_HEADER_REFS_TABLE  = 0x08,
@@ -24,16 +25,49 @@ struct cno_header_t {
     uint8_t /* enum CNO_HEADER_FLAGS */ flags;
 };
 
-struct cno_header_table_t;
+struct cno_hpack_arena_t;
+struct cno_hpack_link_t;
+struct cno_hpack_name_stats_t;
 
 struct cno_hpack_t {
-    struct cno_header_table_t *last;
-    struct cno_header_table_t *first;
+    // Used for the table and for growing buffers passed to the functions below. Set it before
+    // anything is inserted and don't change it afterwards. NULL means the C library's.
+    const struct cno_allocator_t *allocator;
+    // Entries are stored back to back in a ring buffer; `index` is a ring of their offsets
+    // in that buffer, so that the entry inserted `n`-th is at `index[n % index_cap]`.
+    struct cno_hpack_arena_t *arena;
+    uint32_t *index;
+    uint32_t index_cap;  // 0 or a power of 2
+    // Only used by an encoder: `index_cap` chains of entries with equal hashes of names,
+    // then as many chains for names+values. `links` is parallel to `index`.
+    uint32_t *buckets;
+    struct cno_hpack_link_t *links;
+    uint32_t inserted;   // total number of insertions, modulo 2^32
+    uint32_t count;      // number of entries currently in the table
     uint32_t size;
     uint32_t limit;
     uint32_t limit_upper;
     uint32_t limit_update_min;  // only used by an encoder
     uint32_t limit_update_end;
+    // Only used by an encoder: if set, decides whether a header that is not in the dynamic
+    // table should be inserted into it (1) or not (0). Otherwise, the default policy is
+    // to index everything except for names with usually unique values. These are known
+    // in advance (e.g. x-request-id) or detected using the statistics below.
+    int (*index_policy)(void *, const struct cno_header_t *);
+    void *index_policy_data;
+    struct cno_hpack_name_stats_t *name_stats; // allocated by the first encoded header
+};
+
+// A header with everything that does not depend on the state of the dynamic table
+// (hashes, static table index, Huffman-coded name and value) computed in advance.
+struct cno_hpack_prepared_t {
+    struct cno_header_t header; // points into `data`
+    struct cno_buffer_t name_literal;
+    struct cno_buffer_t value_literal;
+    uint32_t hash[2];
+    int static_index; // 0, index (name match), or -index (full match)
+    char *data;
+    size_t data_size; // as allocated
 };
 
 // Initial value for an uninitialized `cno_header_t`.
@@ -42,12 +76,24 @@ static const struct cno_header_t CNO_HEADER_EMPTY = { { NULL, 0 }, { NULL, 0 },
 // Carefully deallocate buffers used to construct a header. (Some of them may be shared.)
 void cno_hpack_free_header(struct cno_header_t *h);
 
+// Same, but for headers decoded by a table with a non-NULL allocator, which must be passed.
+void cno_hpack_free_header_with(const struct cno_allocator_t *, struct cno_header_t *h);
+
 // Construct an empty dynamic table with a given default size limit.
 void cno_hpack_init(struct cno_hpack_t *, uint32_t limit);
 
 // Destroy the dynamic table.
 void cno_hpack_clear(struct cno_hpack_t *);
 
+// Shrink the dynamic table's storage to fit the entries it currently holds, or free it
+// if there are none. It grows back as needed. Headers decoded earlier remain valid.
+int cno_hpack_compact(struct cno_hpack_t *);
+
+// Bytes currently allocated for the dynamic table: the arena, the index, and an encoder's
+// statistics. (Arenas that were replaced but are still referenced by decoded headers are
+// not counted.)
+size_t cno_hpack_memory_usage(const struct cno_hpack_t *);
+
 // Set an encoder's dynamic table size limit. It must not be higher than `limit_upper`,
 // which is set by the peer. (For a decoder, set `limit_upper`; `cno_hpack_decode` will
 // update the actual limit according to what the peer selects.)
@@ -57,10 +103,34 @@ int cno_hpack_setlimit(struct cno_hpack_t *, uint32_t limit);
 // the actual number of headers decoded afterwards. The buffer must outlive the headers.
 int cno_hpack_decode(struct cno_hpack_t *, struct cno_buffer_t, struct cno_header_t *, size_t *n);
 
+// Same as `cno_hpack_decode`, but append Huffman-coded strings to an arena instead of
+// allocating a buffer for each. The headers are only valid until the arena is modified
+// (e.g. its size is reset to 0 to reuse the memory for the next header block).
+int cno_hpack_decode_into(struct cno_hpack_t *, struct cno_buffer_dyn_t *arena,
+                          struct cno_buffer_t, struct cno_header_t *, size_t *n);
+
+// Decode a fragment of a header block, appending headers to `out` (an array of
+// `struct cno_header_t`) and their strings to `arena`. A header split between fragments
+// is left in `buf`, which is shifted past the consumed part; the caller must prepend it to
+// the next fragment. If anything is left after the last fragment, the block is truncated.
+// On error, headers already in `out` must still be freed.
+int cno_hpack_decode_fragment(struct cno_hpack_t *, struct cno_buffer_dyn_t *arena,
+                              struct cno_buffer_dyn_t *out, struct cno_buffer_t *buf);
+
 // Encode exactly `n` headers into a dynamic buffer. If it errors, the buffer may contain
 // partially encoded data. Clear it yourself.
 int cno_hpack_encode(struct cno_hpack_t *, struct cno_buffer_dyn_t *, const struct cno_header_t *, size_t n);
 
+// Make a copy of a header to be encoded by `cno_hpack_encode_prepared` many times. NULL
+// allocator means the C library's.
+int cno_hpack_prepare(const struct cno_allocator_t *, struct cno_hpack_prepared_t *, const struct cno_header_t *);
+
+// Free a header created by `cno_hpack_prepare` with the same allocator.
+void cno_hpack_prepared_clear(const struct cno_allocator_t *, struct cno_hpack_prepared_t *);
+
+// Same as `cno_hpack_encode`, but for prepared headers. Both can be used in one block.
+int cno_hpack_encode_prepared(struct cno_hpack_t *, struct cno_buffer_dyn_t *, const struct cno_hpack_prepared_t *, size_t n);
+
 #if __cplusplus
 }
 #endif
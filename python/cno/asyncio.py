@@ -90,8 +90,8 @@ class Push:
 
 
 class Connection (raw.Connection, asyncio.Protocol):
-    def __init__(self, loop, server, force_http2=False):
-        super().__init__(server)
+    def __init__(self, loop, server, force_http2=False, coalesce_data=False):
+        super().__init__(server, coalesce_data)
         self.loop = loop
         self._data = {} # stream id -> asyncio.StreamReader for current message body
         self._push = {} # stream id -> Channel for push requests
@@ -71,12 +71,13 @@ except NameError:
 
 
 class Connection:
-    def __init__(self, server):
+    def __init__(self, server, coalesce_data=False):
         self.__c = ffi.new('struct cno_connection_t *')
         self.__p = ffi.new_handle(self)
         cno_init(self.__c, CNO_SERVER if server else CNO_CLIENT)
         self.__c.cb_code = self.__make_vtable()
         self.__c.cb_data = self.__p
+        self.coalesce_data = coalesce_data
 
     def __del__(self):
         if hasattr(self, '__c'):
@@ -108,6 +109,16 @@ class Connection:
     def is_http2(self):
         return self.__c.mode == CNO_HTTP2
 
+    @property
+    def coalesce_data(self):
+        '''Pass DATA frames received together as one `on_message_data` call. Every callback
+        is a cffi round trip plus a copy, so fewer bigger chunks are cheaper. Off by default.'''
+        return bool(self.__c.coalesce_data)
+
+    @coalesce_data.setter
+    def coalesce_data(self, value):
+        self.__c.coalesce_data = bool(value)
+
     @property
     def next_stream(self):
         return cno_next_stream(self.__c)